@@ -0,0 +1,142 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "binary_token.h"
+
+#include <string.h>
+
+#include "hash.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+constexpr char kMagic[8] = {'S', 'X', 'O', 'A', 'U', 'T', 'H', '2'};
+constexpr uint32_t kVersion = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_fields;
+  int64_t expiry;
+  uint64_t checksum;  // FNV-1a over everything after the header.
+};
+
+struct TableEntry {
+  uint16_t field;
+  uint16_t reserved;
+  uint32_t offset;  // From the start of the file.
+  uint32_t length;
+};
+
+static_assert(sizeof(Header) == 32, "unexpected header padding");
+static_assert(sizeof(TableEntry) == 12, "unexpected table entry padding");
+
+}  // namespace
+
+/* static */ bool BinaryToken::IsBinary(const void *data, size_t size) {
+  return size >= sizeof(kMagic) && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+bool BinaryToken::Reader::Init(const void *data, size_t size,
+                               std::string *error) {
+  if (!IsBinary(data, size) || size < sizeof(Header)) {
+    *error = "not a binary token file";
+    return false;
+  }
+
+  Header header;
+  memcpy(&header, data, sizeof(header));
+  if (header.version != kVersion) {
+    *error = "unsupported version " + std::to_string(header.version);
+    return false;
+  }
+
+  const char *bytes = static_cast<const char *>(data);
+  if (header.checksum !=
+      Fnv1aHash(bytes + sizeof(Header), size - sizeof(Header))) {
+    *error = "checksum mismatch";
+    return false;
+  }
+
+  const size_t table_size =
+      static_cast<size_t>(header.num_fields) * sizeof(TableEntry);
+  if (table_size > size - sizeof(Header)) {
+    *error = "truncated field table";
+    return false;
+  }
+
+  const char *table = bytes + sizeof(Header);
+  for (uint32_t i = 0; i < header.num_fields; i++) {
+    TableEntry entry;
+    memcpy(&entry, table + i * sizeof(TableEntry), sizeof(entry));
+    if (entry.offset > size || entry.length > size - entry.offset) {
+      *error = "field out of bounds";
+      return false;
+    }
+  }
+
+  data_ = bytes;
+  size_ = size;
+  expiry_ = header.expiry;
+  table_ = table;
+  num_fields_ = header.num_fields;
+  return true;
+}
+
+bool BinaryToken::Reader::Get(Field field, std::string_view *value) const {
+  const char *table = static_cast<const char *>(table_);
+  for (uint32_t i = 0; i < num_fields_; i++) {
+    TableEntry entry;
+    memcpy(&entry, table + i * sizeof(TableEntry), sizeof(entry));
+    if (entry.field == field) {
+      *value = std::string_view(data_ + entry.offset, entry.length);
+      return true;
+    }
+  }
+  return false;
+}
+
+void BinaryToken::Writer::Set(Field field, std::string_view value) {
+  fields_[field] = std::string(value);
+}
+
+std::string BinaryToken::Writer::Serialize() const {
+  Header header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.num_fields = fields_.size();
+  header.expiry = expiry_;
+
+  size_t offset = sizeof(Header) + fields_.size() * sizeof(TableEntry);
+  std::string out(offset, '\0');
+  size_t table_offset = sizeof(Header);
+  for (const auto &[field, value] : fields_) {
+    TableEntry entry = {};
+    entry.field = field;
+    entry.offset = offset;
+    entry.length = value.size();
+    memcpy(&out[table_offset], &entry, sizeof(entry));
+    table_offset += sizeof(entry);
+    out += value;
+    offset += value.size();
+  }
+
+  header.checksum =
+      Fnv1aHash(out.data() + sizeof(Header), out.size() - sizeof(Header));
+  memcpy(&out[0], &header, sizeof(header));
+  return out;
+}
+
+}  // namespace sasl_xoauth2
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_BINARY_TOKEN_H
+#define SASL_XOAUTH2_BINARY_TOKEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace sasl_xoauth2 {
+
+// Compact binary alternative to JSON token files. A file consists of a fixed
+// header (magic, version, expiry, checksum, field count), a table of
+// (field id, offset, length) entries, and the field values themselves. The
+// checksum covers everything after the header, so a file can be validated and
+// its fields read in place (from an mmap-ed file, say) without parsing.
+//
+// Values are stored in host byte order; token files aren't meant to move
+// between machines.
+class BinaryToken {
+ public:
+  enum Field : uint16_t {
+    FIELD_ACCESS_TOKEN = 1,
+    FIELD_REFRESH_TOKEN = 2,
+    FIELD_USER = 3,
+    FIELD_CLIENT_ID = 4,
+    FIELD_CLIENT_SECRET = 5,
+    FIELD_TOKEN_ENDPOINT = 6,
+    FIELD_PROXY = 7,
+    FIELD_CA_BUNDLE_FILE = 8,
+    FIELD_CA_CERTS_DIR = 9,
+    FIELD_REFRESH_WINDOW = 10,
+    FIELD_REFRESH_FAILURES = 11,
+    FIELD_RETRY_AFTER = 12,
+    FIELD_LAST_REFRESH_FAILURE = 13,
+    FIELD_CONNECT_TIMEOUT = 14,
+    FIELD_REQUEST_TIMEOUT = 15,
+    FIELD_LOW_SPEED_LIMIT = 16,
+    FIELD_LOW_SPEED_TIME = 17,
+    FIELD_IP_FAMILY = 18,
+    FIELD_HAPPY_EYEBALLS_TIMEOUT_MS = 19,
+    FIELD_HEDGE_TOKEN_ENDPOINTS = 20,
+  };
+
+  // Returns true if |data| starts with the binary token magic.
+  static bool IsBinary(const void *data, size_t size);
+
+  // Validates |data|. |data| must outlive the returned reader's use.
+  class Reader {
+   public:
+    bool Init(const void *data, size_t size, std::string *error);
+
+    int64_t expiry() const { return expiry_; }
+    // Returns false if |field| isn't present.
+    bool Get(Field field, std::string_view *value) const;
+
+   private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    int64_t expiry_ = 0;
+    const void *table_ = nullptr;
+    uint32_t num_fields_ = 0;
+  };
+
+  class Writer {
+   public:
+    void set_expiry(int64_t expiry) { expiry_ = expiry; }
+    void Set(Field field, std::string_view value);
+
+    std::string Serialize() const;
+
+   private:
+    int64_t expiry_ = 0;
+    std::map<Field, std::string> fields_;
+  };
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_BINARY_TOKEN_H
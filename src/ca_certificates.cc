@@ -0,0 +1,160 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ca_certificates.h"
+
+#include <curl/curl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sasl/sasl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "log.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+std::mutex s_mutex;
+// Entries are never removed (outside of tests), so pointers into the map stay
+// valid.
+std::map<std::string, std::string> s_certificates;
+
+bool ReadFile(int dir_fd, const std::string &name, std::string *contents,
+              std::string *error) {
+  const int fd = openat(dir_fd, name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    *error = "unable to open " + name + ": " + strerror(errno);
+    return false;
+  }
+
+  char buffer[16384];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    contents->append(buffer, n);
+  }
+  if (n < 0) *error = "unable to read " + name + ": " + strerror(errno);
+  close(fd);
+  return n == 0;
+}
+
+// Concatenates the PEM files in |dir|. Hashed directories (see c_rehash)
+// typically hold each certificate under several names, so files are read once
+// per inode.
+bool ReadDirectory(const std::string &dir, std::string *contents,
+                   std::string *error) {
+  const int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *d = dir_fd >= 0 ? fdopendir(dir_fd) : nullptr;
+  if (!d) {
+    *error = "unable to open " + dir + ": " + strerror(errno);
+    if (dir_fd >= 0) close(dir_fd);
+    return false;
+  }
+
+  std::vector<std::string> names;
+  while (dirent *entry = readdir(d)) {
+    if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+  }
+  std::sort(names.begin(), names.end());
+
+  std::set<std::pair<dev_t, ino_t>> seen;
+  bool ok = true;
+  for (const std::string &name : names) {
+    struct stat st = {};
+    if (fstatat(dir_fd, name.c_str(), &st, 0) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    if (!seen.insert({st.st_dev, st.st_ino}).second) continue;
+
+    std::string file;
+    if (!ReadFile(dir_fd, name, &file, error)) {
+      ok = false;
+      break;
+    }
+    if (file.find("-----BEGIN ") == std::string::npos) continue;
+    *contents += file;
+    if (contents->back() != '\n') *contents += '\n';
+  }
+  closedir(d);
+  return ok;
+}
+
+// Returns the bundle curl reads when no CA options are set, if it reports one.
+std::string GetDefaultBundle() {
+#if LIBCURL_VERSION_NUM >= 0x074600  // 7.70.0
+  const curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+  if (info->age >= CURLVERSION_SEVENTH && info->cainfo) return info->cainfo;
+#endif
+  return "";
+}
+
+}  // namespace
+
+/* static */ int CaCertificates::Init(const std::string &bundle_file,
+                                      const std::string &certs_dir) {
+  // The key is what requests will pass, i.e. empty for the default bundle.
+  const std::string &key = certs_dir.empty() ? bundle_file : certs_dir;
+  {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (s_certificates.count(key)) return SASL_OK;
+  }
+
+  std::string contents, error;
+  bool ok = false;
+  if (!certs_dir.empty()) {
+    ok = ReadDirectory(certs_dir, &contents, &error);
+  } else {
+    const std::string path =
+        bundle_file.empty() ? GetDefaultBundle() : bundle_file;
+    if (path.empty()) return SASL_OK;
+    ok = ReadFile(AT_FDCWD, path, &contents, &error);
+  }
+  if (ok && contents.empty()) {
+    error = "no certificates found";
+    ok = false;
+  }
+  if (!ok) {
+    auto log = Log::Create(Log::OPTIONS_IMMEDIATE);
+    log->Write("CaCertificates::Init: %s", error.c_str());
+    return SASL_FAIL;
+  }
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_certificates.emplace(key, std::move(contents));
+  return SASL_OK;
+}
+
+/* static */ const std::string *CaCertificates::Find(const std::string &path) {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  auto it = s_certificates.find(path);
+  return it == s_certificates.end() ? nullptr : &it->second;
+}
+
+/* static */ void CaCertificates::ResetForTesting() {
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_certificates.clear();
+}
+
+}  // namespace sasl_xoauth2
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_CA_CERTIFICATES_H
+#define SASL_XOAUTH2_CA_CERTIFICATES_H
+
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// CA certificates, read into memory once before Postfix chroots and handed to
+// curl as a blob, so that refreshes don't re-read them from disk and the
+// chroot needn't contain copies of them.
+//
+// Certificates are keyed by the ca_bundle_file or ca_certs_dir they were read
+// from (or by an empty path, for curl's default bundle). Requests using any
+// other path fall back to having curl read it.
+class CaCertificates {
+ public:
+  // Loads |certs_dir| if set, |bundle_file| if set, or curl's default bundle
+  // otherwise. Failures are logged, and leave curl to read the path itself.
+  static int Init(const std::string &bundle_file, const std::string &certs_dir);
+
+  // Returns the PEM certificates loaded for |path|, or null.
+  static const std::string *Find(const std::string &path);
+
+  static void ResetForTesting();
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_CA_CERTIFICATES_H
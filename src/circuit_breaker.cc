@@ -0,0 +1,153 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "circuit_breaker.h"
+
+#include <sasl/sasl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <memory>
+
+#include "log.h"
+#include "shared_region.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+// Identifies circuit breaker files, and changes along with kVersion.
+constexpr uint64_t kMagic = 0x73786f6175746362ULL;
+constexpr uint32_t kVersion = 1;
+
+constexpr size_t kMaxEndpoints = 64;
+constexpr size_t kMaxEndpointLength = 256;
+
+// Consecutive failures that open a breaker.
+constexpr uint32_t kFailureThreshold = 5;
+// How long an open breaker refuses requests before allowing a probe.
+constexpr int64_t kOpenSeconds = 30;
+// How long a probe may take before another is allowed (in case the process
+// running it died).
+constexpr int64_t kProbeSeconds = 60;
+
+struct EndpointSlot {
+  enum Breaker : uint32_t { CLOSED = 0, OPEN = 1, HALF_OPEN = 2 };
+
+  // Keyed by endpoint (see SharedSlotTable).
+  std::atomic<uint32_t> state;
+  uint32_t key_length;
+  char key[kMaxEndpointLength];
+
+  std::atomic<uint32_t> breaker;
+  std::atomic<uint32_t> failures;
+  // When OPEN, the end of the cool-down; when HALF_OPEN, the probe's deadline.
+  std::atomic<int64_t> until;
+};
+
+// Layout of the shared file. Zero-filled files are valid, with all breakers
+// closed.
+struct BreakerData {
+  SharedHeader header;
+  SharedSlotTable<EndpointSlot, kMaxEndpoints> endpoints;
+};
+
+// The mapping lives as long as the process (or until ResetForTesting()).
+SharedRegion *s_region = nullptr;
+BreakerData *s_breakers = nullptr;
+
+EndpointSlot *FindSlot(const std::string &endpoint, bool claim) {
+  if (!s_breakers) return nullptr;
+  return s_breakers->endpoints.Find(endpoint, claim);
+}
+
+}  // namespace
+
+/* static */ int CircuitBreaker::Init(const std::string &path) {
+  if (s_breakers || path.empty()) return SASL_OK;
+
+  std::string error;
+  auto region = SharedRegion::Open(path, sizeof(BreakerData),
+                                   /*writable=*/true, &error);
+  auto *data = region ? static_cast<BreakerData *>(region->data()) : nullptr;
+  if (data && !CheckSharedHeader(&data->header, kMagic, kVersion,
+                                 /*writable=*/true)) {
+    error = "unrecognized circuit breaker file format";
+    data = nullptr;
+  }
+  if (!data) {
+    auto log = Log::Create(Log::OPTIONS_IMMEDIATE);
+    log->Write("CircuitBreaker::Init: %s", error.c_str());
+    return SASL_FAIL;
+  }
+
+  s_region = region.release();
+  s_breakers = data;
+  return SASL_OK;
+}
+
+/* static */ bool CircuitBreaker::Allow(const std::string &endpoint) {
+  EndpointSlot *slot = FindSlot(endpoint, /*claim=*/true);
+  if (!slot) return true;
+  if (slot->breaker.load(std::memory_order_acquire) == EndpointSlot::CLOSED)
+    return true;
+
+  // Once the cool-down (or an earlier probe's deadline) has passed, whoever
+  // moves the deadline first gets to probe.
+  const int64_t now = time(nullptr);
+  int64_t until = slot->until.load(std::memory_order_acquire);
+  if (now < until) return false;
+  if (!slot->until.compare_exchange_strong(until, now + kProbeSeconds,
+                                           std::memory_order_acq_rel))
+    return false;
+  slot->breaker.store(EndpointSlot::HALF_OPEN, std::memory_order_release);
+  return true;
+}
+
+/* static */ void CircuitBreaker::Record(const std::string &endpoint,
+                                         bool healthy) {
+  EndpointSlot *slot = FindSlot(endpoint, /*claim=*/true);
+  if (!slot) return;
+
+  if (healthy) {
+    slot->failures.store(0, std::memory_order_relaxed);
+    slot->breaker.store(EndpointSlot::CLOSED, std::memory_order_release);
+    return;
+  }
+
+  const uint32_t failures =
+      slot->failures.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (failures >= kFailureThreshold ||
+      slot->breaker.load(std::memory_order_acquire) != EndpointSlot::CLOSED) {
+    slot->until.store(time(nullptr) + kOpenSeconds, std::memory_order_release);
+    slot->breaker.store(EndpointSlot::OPEN, std::memory_order_release);
+  }
+}
+
+/* static */ bool CircuitBreaker::IsOpen(const std::string &endpoint) {
+  EndpointSlot *slot = FindSlot(endpoint, /*claim=*/false);
+  if (!slot) return false;
+  return slot->breaker.load(std::memory_order_acquire) !=
+             EndpointSlot::CLOSED &&
+         time(nullptr) < slot->until.load(std::memory_order_acquire);
+}
+
+/* static */ void CircuitBreaker::ResetForTesting() {
+  delete s_region;
+  s_region = nullptr;
+  s_breakers = nullptr;
+}
+
+}  // namespace sasl_xoauth2
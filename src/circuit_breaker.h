@@ -0,0 +1,56 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_CIRCUIT_BREAKER_H
+#define SASL_XOAUTH2_CIRCUIT_BREAKER_H
+
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// Per-endpoint circuit breakers, kept in a file shared by every process using
+// the plugin (see SharedRegion), so that once a token endpoint is known to be
+// down, requests to it fail fast everywhere rather than each waiting out
+// curl's timeouts.
+//
+// A breaker starts closed. Enough consecutive failures open it, and requests
+// are refused while it cools down. After that, one request is let through as
+// a probe (half-open): success closes the breaker, failure reopens it.
+//
+// Everything is allowed unless Init() succeeded.
+class CircuitBreaker {
+ public:
+  // Maps |path|, creating it if needed. Does nothing if |path| is empty.
+  static int Init(const std::string &path);
+
+  // Returns false if a request to |endpoint| should be refused. Returning true
+  // for a half-open breaker makes the caller its probe, which must then call
+  // Record().
+  static bool Allow(const std::string &endpoint);
+  // Records the outcome of a request that Allow() let through. |healthy|
+  // should be false only for failures that suggest the endpoint is down
+  // (transport errors, 5xx), not for rejected requests.
+  static void Record(const std::string &endpoint, bool healthy);
+  // Returns true if requests to |endpoint| are currently being refused, or
+  // a probe is in flight.
+  static bool IsOpen(const std::string &endpoint);
+
+  static void ResetForTesting();
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_CIRCUIT_BREAKER_H
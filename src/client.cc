@@ -14,6 +14,7 @@
 
 #include "client.h"
 
+#include <fcntl.h>
 #include <json/json.h>
 #include <string.h>
 
@@ -21,6 +22,9 @@
 
 #include "config.h"
 #include "log.h"
+#include "metrics.h"
+#include "server_challenge.h"
+#include "token_index.h"
 #include "token_store.h"
 
 namespace sasl_xoauth2 {
@@ -151,12 +155,47 @@ Log::Target GetLogTarget() {
 }  // namespace
 
 Client::Client() {
-  log_ = Log::Create(GetLogOptions(), GetLogTarget());
+  Config::MaybeReload();
+  log_target_ = GetLogTarget();
+  log_ = Log::Create(GetLogOptions(), log_target_);
   log_->Write("Client: created");
 }
 
 Client::~Client() { log_->Write("Client: destroyed"); }
 
+void Client::Reset() {
+  log_->Write("Client: reset");
+  Config::MaybeReload();
+  const Log::Target target = GetLogTarget();
+  if (target == log_target_) {
+    log_->Reset(GetLogOptions());
+  } else {
+    // token_ points at the old log, so it can't be kept either.
+    token_.reset();
+    log_target_ = target;
+    log_ = Log::Create(GetLogOptions(), log_target_);
+  }
+
+  state_ = State::kInitial;
+  user_.clear();
+  password_.clear();
+  token_name_.clear();
+}
+
+bool Client::RefreshIdleToken(int margin, int time_limit) {
+  if (!token_) return false;
+  if (token_->Reload() != SASL_OK) {
+    token_.reset();
+    return false;
+  }
+  if (!token_->ExpiresWithin(margin)) return false;
+
+  log_->Write("Client::RefreshIdleToken: token expiring. refreshing.");
+  const int err = token_->RefreshWithin(time_limit);
+  log_->Write("Client::RefreshIdleToken: err=%d", err);
+  return true;
+}
+
 int Client::DoStep(sasl_client_params_t *params, const char *from_server,
                    const unsigned int from_server_len,
                    sasl_interact_t **prompt_need, const char **to_server,
@@ -193,18 +232,31 @@ int Client::InitialStep(sasl_client_params_t *params,
   *to_server = nullptr;
   *to_server_len = 0;
 
-  std::string auth_name;
+  // The auth name is the user unless the token overrides it (below).
+  std::string &auth_name = user_;
+  auth_name.clear();
+  password_.clear();
+  token_name_.clear();
   ReadPrompt(log_.get(), prompt_need, SASL_CB_AUTHNAME, &auth_name);
   if (auth_name.empty()) {
     int err = TriggerAuthNameCallback(log_.get(), params->utils, &auth_name);
     log_->Write("Client::InitialStep: TriggerAuthNameCallback err=%d", err);
   }
 
-  std::string password;
-  ReadPrompt(log_.get(), prompt_need, SASL_CB_PASS, &password);
-  if (password.empty()) {
-    int err = TriggerPasswordCallback(log_.get(), params->utils, &password);
-    log_->Write("Client::InitialStep: TriggerPasswordCallback err=%d", err);
+  // In token directory mode, the password isn't needed if the index has a
+  // token for the user.
+  TokenIndex *index = TokenIndex::Get();
+  if (index && !auth_name.empty() && index->Lookup(auth_name, &token_name_)) {
+    log_->Write("Client::InitialStep: indexed token file=%s",
+                token_name_.c_str());
+  }
+
+  if (token_name_.empty()) {
+    ReadPrompt(log_.get(), prompt_need, SASL_CB_PASS, &password_);
+    if (password_.empty()) {
+      int err = TriggerPasswordCallback(log_.get(), params->utils, &password_);
+      log_->Write("Client::InitialStep: TriggerPasswordCallback err=%d", err);
+    }
   }
 
   if (prompt_need && *prompt_need) {
@@ -212,9 +264,10 @@ int Client::InitialStep(sasl_client_params_t *params,
     *prompt_need = nullptr;
   }
 
-  if (prompt_need && (auth_name.empty() || password.empty())) {
+  const bool need_password = token_name_.empty() && password_.empty();
+  if (prompt_need && (auth_name.empty() || need_password)) {
     return RequestPrompts(params, prompt_need, auth_name.empty(),
-                          password.empty());
+                          need_password);
   }
 
   int err = params->canon_user(params->utils->conn, auth_name.data(),
@@ -222,8 +275,15 @@ int Client::InitialStep(sasl_client_params_t *params,
                                SASL_CU_AUTHID | SASL_CU_AUTHZID, out_params);
   if (err != SASL_OK) return err;
 
-  user_ = auth_name;
-  token_ = TokenStore::Create(log_.get(), password);
+  const int token_dir_fd = token_name_.empty() ? AT_FDCWD : index->dir_fd();
+  const std::string &token_path =
+      token_name_.empty() ? password_ : token_name_;
+  if (token_ && token_->IsFile(token_dir_fd, token_path)) {
+    // Left over from this Client's previous session.
+    if (token_->Reload() != SASL_OK) token_.reset();
+  } else {
+    token_ = TokenStore::CreateAt(log_.get(), token_dir_fd, token_path);
+  }
   if (!token_) return SASL_FAIL;
   if (token_->has_user()) user_ = token_->user();
 
@@ -243,48 +303,64 @@ int Client::TokenSentStep(sasl_client_params_t *params,
   *to_server = nullptr;
   *to_server_len = 0;
 
-  log_->Write("Client::TokenSentStep: from server: %s", from_server);
+  log_->Write("Client::TokenSentStep: from server: %.*s",
+              static_cast<int>(from_server_len), from_server);
 
   if (from_server_len == 0) return SASL_OK;
 
-  std::string from_server_str(from_server, from_server_len);
-  std::stringstream stream(from_server_str);
-  std::string status;
-
-  try {
-    Json::Value root;
-    stream >> root;
-    if (root.isMember("status")) status = root["status"].asString();
-  } catch (const std::exception &e) {
-    log_->Write("Client::TokenSentStep: caught exception: %s", e.what());
-    return SASL_BADPROT;
+  ServerChallenge challenge;
+  std::string status, schemes, scope;
+  if (!ScanServerChallenge(from_server, from_server_len, &challenge)) {
+    log_->Write("Client::TokenSentStep: falling back to full JSON parser");
+    std::string from_server_str(from_server, from_server_len);
+    std::stringstream stream(from_server_str);
+    try {
+      Json::Value root;
+      stream >> root;
+      if (root.isMember("status")) status = root["status"].asString();
+      if (root.isMember("schemes")) schemes = root["schemes"].asString();
+      if (root.isMember("scope")) scope = root["scope"].asString();
+    } catch (const std::exception &e) {
+      log_->Write("Client::TokenSentStep: caught exception: %s", e.what());
+      return SASL_BADPROT;
+    }
+    challenge.status = status;
+    challenge.schemes = schemes;
+    challenge.scope = scope;
   }
 
-  if (status == "400" || status == "401") {
+  log_->Write("Client::TokenSentStep: schemes: %.*s, scope: %.*s",
+              static_cast<int>(challenge.schemes.size()),
+              challenge.schemes.data(),
+              static_cast<int>(challenge.scope.size()), challenge.scope.data());
+
+  if (challenge.status == "400" || challenge.status == "401") {
     int err = token_->Refresh();
     if (err != SASL_OK) return err;
+    Metrics::Increment(Metrics::SERVER_RETRIES);
     return SASL_TRYAGAIN;
   }
 
-  if (status.empty()) {
+  if (challenge.status.empty()) {
     log_->Write("Client::TokenSentStep: blank status, assuming we're okay");
     return SASL_OK;
   }
 
-  log_->Write("Client::TokenSentStep: status: %s", status.c_str());
+  log_->Write("Client::TokenSentStep: status: %.*s",
+              static_cast<int>(challenge.status.size()),
+              challenge.status.data());
   return SASL_BADPROT;
 }
 
 int Client::SendToken(const char **to_server, unsigned int *to_server_len) {
-  std::string token;
-  int err = token_->GetAccessToken(&token);
+  const std::string *response = nullptr;
+  int err = token_->GetInitialResponse(user_, &response);
   if (err != SASL_OK) return err;
 
-  response_ = "user=" + user_ + "\1auth=Bearer " + token + "\1\1";
-  log_->Write("Client::SendToken: response: %s", response_.c_str());
+  log_->Write("Client::SendToken: response: %s", response->c_str());
 
-  *to_server = response_.data();
-  *to_server_len = response_.size();
+  *to_server = response->data();
+  *to_server_len = response->size();
 
   return SASL_OK;
 }
@@ -23,9 +23,10 @@
 #include <memory>
 #include <string>
 
+#include "log.h"
+
 namespace sasl_xoauth2 {
 
-class Log;
 class TokenStore;
 
 class Client {
@@ -33,6 +34,15 @@ class Client {
   Client();
   ~Client();
 
+  // Ends the current session and readies the Client for another, keeping its
+  // log buffers, strings, and (if the next session uses the same file) token.
+  void Reset();
+
+  // Between sessions, refreshes the token kept from the last one if it
+  // expires within |margin| seconds, taking at most |time_limit| seconds.
+  // Returns true if it tried to.
+  bool RefreshIdleToken(int margin, int time_limit);
+
   int DoStep(sasl_client_params_t *params, const char *from_server,
              const unsigned int from_server_len, sasl_interact_t **prompt_need,
              const char **to_server, unsigned int *to_server_len,
@@ -57,10 +67,12 @@ class Client {
 
   State state_ = State::kInitial;
   std::string user_;
-  std::string response_;
+  std::string password_;
+  std::string token_name_;
 
   // Order of destruction matters -- token_ holds a pointer to log_.
   std::unique_ptr<Log> log_;
+  Log::Target log_target_;
   std::unique_ptr<TokenStore> token_;
 };
 
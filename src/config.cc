@@ -15,14 +15,19 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sasl/sasl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include <algorithm>
-#include <fstream>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <sstream>
 
 namespace sasl_xoauth2 {
@@ -31,8 +36,27 @@ namespace {
 
 constexpr char kConfigFilePath[] = CONFIG_FILE_FULL_PATH;
 
+// Minimum time between checks for config file changes.
+constexpr time_t kReloadCheckIntervalSec = 1;
+
 bool s_log_to_stderr = false;
-Config *s_config = nullptr;
+std::atomic<Config *> s_config = nullptr;
+
+// Where the config file is, for reloads. The directory is opened by Init(),
+// before any chroot.
+struct Source {
+  int dir_fd = -1;
+  std::string name;
+  struct stat st = {};  // As of the last load.
+};
+
+Source s_source;
+std::mutex s_reload_mutex;
+std::atomic<bool> s_reload_requested = false;
+std::atomic<time_t> s_next_check = 0;
+
+static_assert(std::atomic<bool>::is_always_lock_free,
+              "RequestReload() must be async-signal-safe");
 
 void Log(const char *fmt, ...) {
   va_list args;
@@ -81,6 +105,20 @@ int Transform(std::string in, int *out) {
   return SASL_OK;
 }
 
+template <>
+int Transform(std::string in, HttpTransportOptions::IpFamily *out) {
+  if (ParseIpFamily(in, out)) return SASL_OK;
+  Log("sasl-xoauth2: Invalid value '%s'. Need 'any', 'ipv4', or 'ipv6'.\n",
+      in.c_str());
+  return SASL_FAIL;
+}
+
+template <>
+int Transform(std::string in, std::vector<std::string> *out) {
+  *out = ParseUrlList(in);
+  return SASL_OK;
+}
+
 template <typename T>
 int Fetch(const Json::Value &root, const std::string &name, bool optional,
           T *out) {
@@ -92,53 +130,159 @@ int Fetch(const Json::Value &root, const std::string &name, bool optional,
   return Transform(root[name].asString(), out);
 }
 
+bool SameFile(const struct stat &a, const struct stat &b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+         a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+         a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+int ReadConfigFile(int dir_fd, const std::string &name, Json::Value *root,
+                   struct stat *st) {
+  int fd = openat(dir_fd, name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    Log("sasl-xoauth2: Unable to open config file %s: %s\n", name.c_str(),
+        strerror(errno));
+    return SASL_FAIL;
+  }
+
+  std::string contents;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    contents.append(buffer, n);
+  }
+  const bool ok = (n == 0) && fstat(fd, st) == 0;
+  close(fd);
+  if (!ok) {
+    Log("sasl-xoauth2: Unable to read config file %s: %s\n", name.c_str(),
+        strerror(errno));
+    return SASL_FAIL;
+  }
+
+  try {
+    std::stringstream ss(contents);
+    ss >> *root;
+  } catch (const std::exception &e) {
+    Log("sasl-xoauth2: Exception during init: %s\n", e.what());
+    return SASL_FAIL;
+  }
+  return SASL_OK;
+}
+
 }  // namespace
 
 void Config::EnableLoggingToStderr() { s_log_to_stderr = true; }
 
 int Config::Init(std::string path) {
   // Fail silently if we've already been initialized (via InitForTesting, say).
-  if (s_config) return SASL_OK;
+  if (s_config.load(std::memory_order_acquire)) return SASL_OK;
 
   if (path.empty()) {
     path = kConfigFilePath;
   }
 
-  try {
-    std::ifstream f(path);
-    if (!f.good()) {
-      Log("sasl-xoauth2: Unable to open config file %s: %s\n", path.c_str(),
-          strerror(errno));
-      return SASL_FAIL;
-    }
-
-    Json::Value root;
-    f >> root;
-    s_config = new Config();
-    return s_config->Init(root);
+  int err = Watch(path);
+  if (err != SASL_OK) return err;
 
-  } catch (const std::exception &e) {
-    Log("sasl-xoauth2: Exception during init: %s\n", e.what());
-    return SASL_FAIL;
-  }
+  Json::Value root;
+  err = ReadConfigFile(s_source.dir_fd, s_source.name, &root, &s_source.st);
+  if (err != SASL_OK) return err;
+
+  Config *config = new Config();
+  s_config.store(config, std::memory_order_release);
+  return config->Init(root);
 }
 
 int Config::InitForTesting(const Json::Value &root) {
-  if (s_config) {
+  if (s_config.load(std::memory_order_acquire)) {
     Log("sasl-xoauth2: Already initialized!\n");
     exit(1);
   }
 
-  s_config = new Config();
-  return s_config->Init(root);
+  Config *config = new Config();
+  s_config.store(config, std::memory_order_release);
+  return config->Init(root);
+}
+
+int Config::WatchForTesting(const std::string &path) {
+  int err = Watch(path);
+  if (err != SASL_OK) return err;
+  if (fstatat(s_source.dir_fd, s_source.name.c_str(), &s_source.st, 0) != 0)
+    return SASL_FAIL;
+  return SASL_OK;
+}
+
+void Config::MaybeReload() {
+  if (s_source.dir_fd < 0) return;
+
+  const time_t now = time(nullptr);
+  if (!s_reload_requested.load(std::memory_order_relaxed) &&
+      now < s_next_check.load(std::memory_order_relaxed))
+    return;
+
+  // Let whoever's already checking do so on our behalf. A requested reload
+  // stays requested until someone holding the lock sees it, so that it isn't
+  // lost to a check that has already found the file unchanged.
+  std::unique_lock<std::mutex> lock(s_reload_mutex, std::try_to_lock);
+  if (!lock.owns_lock()) return;
+  const bool requested =
+      s_reload_requested.exchange(false, std::memory_order_relaxed);
+  s_next_check.store(now + kReloadCheckIntervalSec, std::memory_order_relaxed);
+
+  struct stat st = {};
+  if (fstatat(s_source.dir_fd, s_source.name.c_str(), &st, 0) != 0) return;
+  if (!requested && SameFile(st, s_source.st)) return;
+
+  Json::Value root;
+  if (ReadConfigFile(s_source.dir_fd, s_source.name, &root, &st) != SASL_OK)
+    return;
+  s_source.st = st;
+
+  std::unique_ptr<Config> config(new Config());
+  if (config->Init(root) != SASL_OK) {
+    Log("sasl-xoauth2: Not reloading invalid config file %s.\n",
+        s_source.name.c_str());
+    return;
+  }
+
+  // Readers may still hold the previous snapshot, and there's no telling when
+  // they're done with it, so it's never freed. Reloads are rare.
+  s_config.store(config.release(), std::memory_order_release);
+  Log("sasl-xoauth2: Reloaded config file %s.\n", s_source.name.c_str());
+}
+
+void Config::RequestReload() {
+  s_reload_requested.store(true, std::memory_order_relaxed);
 }
 
-Config *Config::Get() {
-  if (!s_config) {
+const Config *Config::Get() {
+  const Config *config = s_config.load(std::memory_order_acquire);
+  if (!config) {
     Log("sasl-xoauth2: Attempt to fetch before calling Init()!\n");
     exit(1);
   }
-  return s_config;
+  return config;
+}
+
+int Config::Watch(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  const std::string dir =
+      (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+  const int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    Log("sasl-xoauth2: Unable to open config file %s: %s\n", path.c_str(),
+        strerror(errno));
+    return SASL_FAIL;
+  }
+
+  if (s_source.dir_fd >= 0) close(s_source.dir_fd);
+  s_source.dir_fd = dir_fd;
+  s_source.name =
+      (slash == std::string::npos) ? path : path.substr(slash + 1);
+  s_next_check.store(0, std::memory_order_relaxed);
+  return SASL_OK;
 }
 
 int Config::Init(const Json::Value &root) {
@@ -166,18 +310,71 @@ int Config::Init(const Json::Value &root) {
     err = Fetch(root, "token_endpoint", true, &token_endpoint_);
     if (err != SASL_OK) return err;
 
+    err = Fetch(root, "hedge_token_endpoints", true, &hedge_token_endpoints_);
+    if (err != SASL_OK) return err;
+
     err = Fetch(root, "refresh_window", true, &refresh_window_);
     if (err != SASL_OK) return err;
 
     err = Fetch(root, "proxy", true, &proxy_);
     if (err != SASL_OK) return err;
 
+    err = Fetch(root, "connect_timeout", true, &transport_.connect_timeout);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "request_timeout", true, &transport_.request_timeout);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "low_speed_limit", true, &transport_.low_speed_limit);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "low_speed_time", true, &transport_.low_speed_time);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "ip_family", true, &transport_.ip_family);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "happy_eyeballs_timeout_ms", true,
+                &transport_.happy_eyeballs_timeout_ms);
+    if (err != SASL_OK) return err;
+
     err = Fetch(root, "ca_bundle_file", true, &ca_bundle_file_);
     if (err != SASL_OK) return err;
 
     err = Fetch(root, "ca_certs_dir", true, &ca_certs_dir_);
     if (err != SASL_OK) return err;
 
+    err = Fetch(root, "token_directory", true, &token_directory_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "async_refresh", true, &async_refresh_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "idle_refresh_margin", true, &idle_refresh_margin_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "idle_refresh_timeout", true, &idle_refresh_timeout_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "metrics_file", true, &metrics_file_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "shared_token_cache", true, &shared_token_cache_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "circuit_breaker_file", true, &circuit_breaker_file_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "refresh_rate_limit_file", true,
+                &refresh_rate_limit_file_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "refresh_rate_limit", true, &refresh_rate_limit_);
+    if (err != SASL_OK) return err;
+
+    err = Fetch(root, "refresh_rate_burst", true, &refresh_rate_burst_);
+    if (err != SASL_OK) return err;
+
     return 0;
 
   } catch (const std::exception &e) {
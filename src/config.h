@@ -20,6 +20,9 @@
 #include <json/json.h>
 
 #include <string>
+#include <vector>
+
+#include "http.h"
 
 namespace sasl_xoauth2 {
 
@@ -29,23 +32,56 @@ class Config {
 
   static int Init(std::string path = "");
   static int InitForTesting(const Json::Value &root);
+  // Watches |path| for changes, as Init() does, without loading it.
+  static int WatchForTesting(const std::string &path);
+
+  // Reloads the config file if it's changed (or RequestReload() was called)
+  // since it was last loaded. Checks are rate-limited, so this is cheap enough
+  // to call per authentication. Settings only used at startup
+  // (token_directory, metrics_file, shared_token_cache, circuit_breaker_file)
+  // aren't affected.
+  static void MaybeReload();
+  // Forces the next MaybeReload() to reload. Async-signal-safe.
+  static void RequestReload();
 
-  static Config *Get();
+  // Returns the current config. Configs are immutable and never freed, so the
+  // result remains usable (if stale) across reloads.
+  static const Config *Get();
 
-  std::string client_id() const { return client_id_; }
-  std::string client_secret() const { return client_secret_; }
+  const std::string &client_id() const { return client_id_; }
+  const std::string &client_secret() const { return client_secret_; }
   bool always_log_to_syslog() const { return always_log_to_syslog_; }
   bool log_to_syslog_on_failure() const { return log_to_syslog_on_failure_; }
   bool log_full_trace_on_failure() const { return log_full_trace_on_failure_; }
-  std::string token_endpoint() const { return token_endpoint_; }
-  std::string proxy() const { return proxy_; }
-  std::string ca_bundle_file() const { return ca_bundle_file_; }
-  std::string ca_certs_dir() const { return ca_certs_dir_; }
+  const std::string &token_endpoint() const { return token_endpoint_; }
+  const std::vector<std::string> &hedge_token_endpoints() const {
+    return hedge_token_endpoints_;
+  }
+  const std::string &proxy() const { return proxy_; }
+  const std::string &ca_bundle_file() const { return ca_bundle_file_; }
+  const std::string &ca_certs_dir() const { return ca_certs_dir_; }
   int refresh_window() const { return refresh_window_; }
+  const HttpTransportOptions &transport() const { return transport_; }
+  const std::string &token_directory() const { return token_directory_; }
+  bool async_refresh() const { return async_refresh_; }
+  int idle_refresh_margin() const { return idle_refresh_margin_; }
+  int idle_refresh_timeout() const { return idle_refresh_timeout_; }
+  const std::string &metrics_file() const { return metrics_file_; }
+  const std::string &shared_token_cache() const { return shared_token_cache_; }
+  const std::string &circuit_breaker_file() const {
+    return circuit_breaker_file_;
+  }
+  const std::string &refresh_rate_limit_file() const {
+    return refresh_rate_limit_file_;
+  }
+  int refresh_rate_limit() const { return refresh_rate_limit_; }
+  int refresh_rate_burst() const { return refresh_rate_burst_; }
 
  private:
   Config() = default;
 
+  static int Watch(const std::string &path);
+
   int Init(const Json::Value &root);
 
   std::string client_id_;
@@ -54,10 +90,23 @@ class Config {
   bool log_to_syslog_on_failure_ = true;
   bool log_full_trace_on_failure_ = false;
   std::string token_endpoint_ = "https://accounts.google.com/o/oauth2/token";
+  std::vector<std::string> hedge_token_endpoints_;
   std::string proxy_ = "";
   std::string ca_bundle_file_ = "";
   std::string ca_certs_dir_ = "";
   int refresh_window_ = 10;  // seconds
+  HttpTransportOptions transport_ = {.connect_timeout = 10,
+                                     .request_timeout = 30};
+  std::string token_directory_ = "";
+  bool async_refresh_ = false;
+  int idle_refresh_margin_ = 0;   // seconds; 0 disables idle refreshes
+  int idle_refresh_timeout_ = 2;  // seconds
+  std::string metrics_file_ = "";
+  std::string shared_token_cache_ = "";
+  std::string circuit_breaker_file_ = "";
+  std::string refresh_rate_limit_file_ = "";
+  int refresh_rate_limit_ = 60;  // per minute, per endpoint and client
+  int refresh_rate_burst_ = 10;
 };
 
 }  // namespace sasl_xoauth2
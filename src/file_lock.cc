@@ -0,0 +1,64 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_lock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+namespace sasl_xoauth2 {
+
+/* static */ std::unique_ptr<FileLock> FileLock::Acquire(
+    int dir_fd, const std::string &path, std::string *error) {
+  return Lock(dir_fd, path, LOCK_EX, error);
+}
+
+/* static */ std::unique_ptr<FileLock> FileLock::TryAcquire(
+    int dir_fd, const std::string &path, std::string *error) {
+  return Lock(dir_fd, path, LOCK_EX | LOCK_NB, error);
+}
+
+/* static */ std::unique_ptr<FileLock> FileLock::Lock(int dir_fd,
+                                                      const std::string &path,
+                                                      int operation,
+                                                      std::string *error) {
+  int fd = openat(dir_fd, path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    *error = std::string("open failed: ") + strerror(errno);
+    return {};
+  }
+
+  int err;
+  do {
+    err = flock(fd, operation);
+  } while (err != 0 && errno == EINTR);
+
+  if (err != 0) {
+    *error = std::string("flock failed: ") + strerror(errno);
+    close(fd);
+    return {};
+  }
+
+  return std::unique_ptr<FileLock>(new FileLock(fd));
+}
+
+FileLock::~FileLock() {
+  flock(fd_, LOCK_UN);
+  close(fd_);
+}
+
+}  // namespace sasl_xoauth2
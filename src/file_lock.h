@@ -0,0 +1,55 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_FILE_LOCK_H
+#define SASL_XOAUTH2_FILE_LOCK_H
+
+#include <memory>
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// Holds an advisory (flock) exclusive lock on a file for its lifetime. The
+// lock file is created if missing, and is never deleted (deleting it would
+// allow two processes to hold "the" lock on different inodes).
+class FileLock {
+ public:
+  // Blocks until the lock is held. Returns null, and sets |error|, on failure.
+  // As with openat(), a relative |path| is resolved against |dir_fd|.
+  static std::unique_ptr<FileLock> Acquire(int dir_fd, const std::string &path,
+                                           std::string *error);
+  // Like Acquire(), but fails immediately if the lock is held elsewhere.
+  static std::unique_ptr<FileLock> TryAcquire(int dir_fd,
+                                              const std::string &path,
+                                              std::string *error);
+
+  ~FileLock();
+
+  FileLock(const FileLock &) = delete;
+  FileLock &operator=(const FileLock &) = delete;
+
+ private:
+  explicit FileLock(int fd) : fd_(fd) {}
+
+  static std::unique_ptr<FileLock> Lock(int dir_fd, const std::string &path,
+                                        int operation, std::string *error);
+
+  const int fd_;
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_FILE_LOCK_H
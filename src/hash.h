@@ -0,0 +1,37 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_HASH_H
+#define SASL_XOAUTH2_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// 64-bit FNV-1a. Fast, and fine for hash tables and checksums, but not
+// cryptographic.
+uint64_t Fnv1aHash(const char *data, size_t size);
+
+inline uint64_t Fnv1aHash(const std::string &value) {
+  return Fnv1aHash(value.data(), value.size());
+}
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_HASH_H
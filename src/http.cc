@@ -18,9 +18,19 @@
 #include <sasl/sasl.h>
 #include <string.h>
 
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <vector>
 
+#include "ca_certificates.h"
+#include "circuit_breaker.h"
+#include "metrics.h"
+
 namespace sasl_xoauth2 {
 
 namespace {
@@ -32,6 +42,101 @@ using UniqueCURL = std::unique_ptr<CURL, CURLDeleter>;
 
 constexpr char kUserAgent[] = "sasl xoauth2 token refresher";
 
+// Maximum number of idle handles kept per pool key.
+constexpr size_t kMaxIdleHandlesPerKey = 4;
+
+// Longest HedgedPost() waits for activity before re-checking its transfers.
+constexpr int kHedgePollMs = 1000;
+
+// Reusable CURL handles. Idle handles keep their connections alive between
+// requests, and all handles share one DNS cache and TLS session cache, so that
+// consecutive requests to the same token endpoint can skip name resolution and
+// the TLS handshake. Connection caches aren't shared: handles are used from
+// several threads at once, which curl doesn't support for shared connections.
+class HandlePool {
+ public:
+  static HandlePool *Get() {
+    // Intentionally leaked, to avoid destruction-order issues at exit.
+    static HandlePool *s_pool = new HandlePool();
+    return s_pool;
+  }
+
+  // Returns an idle handle for |key| if there is one, or a new handle.
+  UniqueCURL Acquire(const std::string &key) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &idle = idle_[key];
+      if (!idle.empty()) {
+        UniqueCURL curl = std::move(idle.back());
+        idle.pop_back();
+        return curl;
+      }
+    }
+    return UniqueCURL(curl_easy_init());
+  }
+
+  // Returns |curl| to the pool. Options are reset, but curl keeps the handle's
+  // live connections and caches.
+  void Release(const std::string &key, UniqueCURL curl) {
+    curl_easy_reset(curl.get());
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &idle = idle_[key];
+    if (idle.size() < kMaxIdleHandlesPerKey) idle.push_back(std::move(curl));
+  }
+
+  CURLSH *share() const { return share_; }
+
+ private:
+  HandlePool() {
+    share_ = curl_share_init();
+    if (!share_) return;
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &HandlePool::Lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &HandlePool::Unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  static void Lock(CURL *, curl_lock_data data, curl_lock_access,
+                   void *context) {
+    static_cast<HandlePool *>(context)->share_mutex_[data].lock();
+  }
+
+  static void Unlock(CURL *, curl_lock_data data, void *context) {
+    static_cast<HandlePool *>(context)->share_mutex_[data].unlock();
+  }
+
+  CURLSH *share_ = nullptr;
+  std::mutex share_mutex_[CURL_LOCK_DATA_LAST];
+
+  std::mutex mutex_;
+  std::map<std::string, std::vector<UniqueCURL>> idle_;
+};
+
+// Returns a new handle from |pool| to the pool when destroyed.
+class PooledHandle {
+ public:
+  PooledHandle(HandlePool *pool, std::string key)
+      : pool_(pool), key_(std::move(key)), curl_(pool_->Acquire(key_)) {}
+
+  ~PooledHandle() {
+    if (curl_) pool_->Release(key_, std::move(curl_));
+  }
+
+  CURL *get() const { return curl_.get(); }
+  explicit operator bool() const { return static_cast<bool>(curl_); }
+
+ private:
+  HandlePool *const pool_;
+  const std::string key_;
+  UniqueCURL curl_;
+};
+
+std::string GetPoolKey(const HttpPostOptions &options) {
+  return options.url + '\n' + options.proxy + '\n' + options.ca_bundle_file +
+         '\n' + options.ca_certs_dir;
+}
+
 class RequestContext {
  public:
   static size_t Read(char *data, size_t size, size_t items, void *context) {
@@ -50,9 +155,8 @@ class RequestContext {
     size *= items;
 
     auto *request = static_cast<RequestContext *>(context);
-    size_t old_size = request->from_server_.size();
-    request->from_server_.resize(old_size + size);
-    memcpy(&request->from_server_[old_size], data, size);
+    request->from_server_.append(data, size);
+    if (request->on_data_) request->on_data_(data, size);
 
     return size;
   }
@@ -64,13 +168,14 @@ class RequestContext {
     return CURL_SEEKFUNC_OK;
   }
 
-  RequestContext(const std::string &data) : to_server_(data) { Rewind(); }
+  RequestContext(const std::string &data, HttpDataCallback on_data)
+      : to_server_(data), on_data_(std::move(on_data)) {
+    Rewind();
+  }
 
   size_t to_server_size() const { return to_server_.size(); }
 
-  std::string from_server() const {
-    return std::string(from_server_.begin(), from_server_.end());
-  }
+  std::string TakeFromServer() { return std::move(from_server_); }
 
  private:
   void Rewind() {
@@ -82,86 +187,719 @@ class RequestContext {
   const char *to_server_next_ = nullptr;
   size_t to_server_remaining_ = 0;
 
-  std::vector<char> from_server_;
+  const HttpDataCallback on_data_;
+  std::string from_server_;
 };
 
 HttpIntercept s_intercept = {};
 
-}  // namespace
-
-void SetHttpInterceptForTesting(HttpIntercept intercept) {
-  s_intercept = intercept;
-}
-
-int HttpPost(HttpPostOptions options) {
-  if (s_intercept) return s_intercept(options);
-
-  *options.response_code = 0;
-  options.response->clear();
-
-  UniqueCURL curl(curl_easy_init());
-  if (!curl) {
-    *options.error = "Unable to create CURL handle.";
-    return SASL_BADPROT;
-  }
-
-  RequestContext context(options.data);
-
-  char transport_error[CURL_ERROR_SIZE] = {'\0'};
+void ConfigureHandle(CURL *curl, const HttpPostOptions &options,
+                     RequestContext *context, char *transport_error) {
+  // Connection reuse.
+  CURLSH *share = HandlePool::Get()->share();
+  if (share) curl_easy_setopt(curl, CURLOPT_SHARE, share);
 
   // Behavior.
-  curl_easy_setopt(curl.get(), CURLOPT_VERBOSE, false);
-  curl_easy_setopt(curl.get(), CURLOPT_NOPROGRESS, true);
-  curl_easy_setopt(curl.get(), CURLOPT_NOSIGNAL, true);
+  curl_easy_setopt(curl, CURLOPT_VERBOSE, false);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, true);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, true);
 
   // Errors.
-  curl_easy_setopt(curl.get(), CURLOPT_ERRORBUFFER, transport_error);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, transport_error);
 
   // Network.
-  curl_easy_setopt(curl.get(), CURLOPT_URL, options.url.c_str());
-
-  // Certs.
-  if (options.ca_certs_dir.empty()) {
+  curl_easy_setopt(curl, CURLOPT_URL, options.url.c_str());
+  const HttpTransportOptions &transport = options.transport;
+  if (transport.connect_timeout > 0) {
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT,
+                     static_cast<long>(transport.connect_timeout));
+  }
+  if (transport.request_timeout > 0) {
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT,
+                     static_cast<long>(transport.request_timeout));
+  }
+  if (transport.low_speed_limit > 0 && transport.low_speed_time > 0) {
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT,
+                     static_cast<long>(transport.low_speed_limit));
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+                     static_cast<long>(transport.low_speed_time));
+  }
+  if (transport.ip_family == HttpTransportOptions::IP_FAMILY_V4)
+    curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
+  else if (transport.ip_family == HttpTransportOptions::IP_FAMILY_V6)
+    curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V6);
+#if LIBCURL_VERSION_NUM >= 0x073b00  // 7.59.0
+  if (transport.happy_eyeballs_timeout_ms > 0) {
+    curl_easy_setopt(curl, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS,
+                     static_cast<long>(transport.happy_eyeballs_timeout_ms));
+  }
+#endif
+
+  // Certs. Prefer copies loaded before the chroot, where the TLS backend can
+  // take them from memory.
+  const std::string *certificates = CaCertificates::Find(
+      options.ca_certs_dir.empty() ? options.ca_bundle_file
+                                   : options.ca_certs_dir);
+#if LIBCURL_VERSION_NUM >= 0x074d00  // 7.77.0
+  if (certificates) {
+    curl_blob blob = {};
+    blob.data = const_cast<char *>(certificates->data());
+    blob.len = certificates->size();
+    blob.flags = CURL_BLOB_NOCOPY;
+    if (curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, &blob) != CURLE_OK)
+      certificates = nullptr;
+  }
+#else
+  certificates = nullptr;
+#endif
+  if (certificates) {
+    // Don't also read curl's default locations.
+    curl_easy_setopt(curl, CURLOPT_CAINFO, nullptr);
+    curl_easy_setopt(curl, CURLOPT_CAPATH, nullptr);
+  } else if (options.ca_certs_dir.empty()) {
     if (options.ca_bundle_file.empty()) {
       // Use default CA location.
     } else {
-      curl_easy_setopt(curl.get(), CURLOPT_CAINFO, options.ca_bundle_file.c_str());
+      curl_easy_setopt(curl, CURLOPT_CAINFO, options.ca_bundle_file.c_str());
     }
   } else {
-    curl_easy_setopt(curl.get(), CURLOPT_CAPATH, options.ca_certs_dir.c_str());
+    curl_easy_setopt(curl, CURLOPT_CAPATH, options.ca_certs_dir.c_str());
   }
 
   // HTTP.
-  curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, true);
-  curl_easy_setopt(curl.get(), CURLOPT_USERAGENT, kUserAgent);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, kUserAgent);
   if (!options.proxy.empty())
-    curl_easy_setopt(curl.get(), CURLOPT_PROXY, options.proxy.c_str());
-  curl_easy_setopt(curl.get(), CURLOPT_POST, true);
-  curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDSIZE_LARGE,
-                   static_cast<curl_off_t>(context.to_server_size()));
+    curl_easy_setopt(curl, CURLOPT_PROXY, options.proxy.c_str());
+  curl_easy_setopt(curl, CURLOPT_POST, true);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                   static_cast<curl_off_t>(context->to_server_size()));
 
   // Callbacks.
-  curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, &RequestContext::Write);
-  curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &context);
-  curl_easy_setopt(curl.get(), CURLOPT_READFUNCTION, &RequestContext::Read);
-  curl_easy_setopt(curl.get(), CURLOPT_READDATA, &context);
-  curl_easy_setopt(curl.get(), CURLOPT_SEEKFUNCTION, &RequestContext::Seek);
-  curl_easy_setopt(curl.get(), CURLOPT_SEEKDATA, &context);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &RequestContext::Write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, context);
+  curl_easy_setopt(curl, CURLOPT_READFUNCTION, &RequestContext::Read);
+  curl_easy_setopt(curl, CURLOPT_READDATA, context);
+  curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, &RequestContext::Seek);
+  curl_easy_setopt(curl, CURLOPT_SEEKDATA, context);
+}
+
+std::string GetTransportError(CURLcode err, const char *transport_error) {
+  std::string error = transport_error;
+  if (error.empty()) {
+    error = curl_easy_strerror(err);
+    error += " (no further error information)";
+  }
+  return error;
+}
+
+void GetTimings(CURL *curl, const std::string &proxy, HttpTimings *timings) {
+  auto get = [curl](CURLINFO info, std::chrono::microseconds *time) {
+#if LIBCURL_VERSION_NUM >= 0x073d00  // 7.61.0
+    curl_off_t us = 0;
+    if (curl_easy_getinfo(curl, info, &us) == CURLE_OK)
+      *time = std::chrono::microseconds(us);
+#else
+    double seconds = 0;
+    if (curl_easy_getinfo(curl, info, &seconds) == CURLE_OK)
+      *time = std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+#endif
+  };
+#if LIBCURL_VERSION_NUM >= 0x073d00  // 7.61.0
+  get(CURLINFO_NAMELOOKUP_TIME_T, &timings->name_lookup);
+  get(CURLINFO_CONNECT_TIME_T, &timings->connect);
+  get(CURLINFO_APPCONNECT_TIME_T, &timings->app_connect);
+  get(CURLINFO_PRETRANSFER_TIME_T, &timings->pre_transfer);
+  get(CURLINFO_STARTTRANSFER_TIME_T, &timings->start_transfer);
+  get(CURLINFO_TOTAL_TIME_T, &timings->total);
+#else
+  get(CURLINFO_NAMELOOKUP_TIME, &timings->name_lookup);
+  get(CURLINFO_CONNECT_TIME, &timings->connect);
+  get(CURLINFO_APPCONNECT_TIME, &timings->app_connect);
+  get(CURLINFO_PRETRANSFER_TIME, &timings->pre_transfer);
+  get(CURLINFO_STARTTRANSFER_TIME, &timings->start_transfer);
+  get(CURLINFO_TOTAL_TIME, &timings->total);
+#endif
+
+  long connects = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  timings->connection_reused = connects == 0;
+
+#if LIBCURL_VERSION_NUM >= 0x080700  // 8.7.0
+  long used_proxy = 0;
+  curl_easy_getinfo(curl, CURLINFO_USED_PROXY, &used_proxy);
+  timings->proxied = used_proxy != 0;
+#else
+  // Misses proxies set through the environment.
+  timings->proxied = !proxy.empty();
+#endif
+}
+
+// Records the time from construction to destruction as request latency.
+class LatencyRecorder {
+ public:
+  ~LatencyRecorder() {
+    Metrics::RecordHttpLatency(std::chrono::steady_clock::now() - start_);
+  }
+
+ private:
+  const std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+};
+
+// Latencies of recent healthy requests, from which HedgedPost() decides how
+// long to wait before hedging.
+class LatencyTracker {
+ public:
+  static LatencyTracker *Get() {
+    // Intentionally leaked, like HandlePool.
+    static LatencyTracker *s_tracker = new LatencyTracker();
+    return s_tracker;
+  }
+
+  void Record(std::chrono::steady_clock::duration latency) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_[next_] =
+        std::chrono::duration_cast<std::chrono::milliseconds>(latency);
+    next_ = (next_ + 1) % kSamples;
+    count_ = std::min(count_ + 1, kSamples);
+  }
+
+  // Returns the kHedgePercentile-th percentile of recent latencies, or
+  // kInitialHedgeDelay until there are enough of them.
+  std::chrono::milliseconds GetHedgeDelay() {
+    std::chrono::milliseconds sorted[kSamples];
+    size_t count = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (count_ < kMinSamples) return kInitialHedgeDelay;
+      count = count_;
+      std::copy(samples_, samples_ + count, sorted);
+    }
+    std::chrono::milliseconds *percentile =
+        sorted + (count - 1) * kHedgePercentile / 100;
+    std::nth_element(sorted, percentile, sorted + count);
+    return std::max(*percentile, kMinHedgeDelay);
+  }
+
+ private:
+  static constexpr size_t kSamples = 64;
+  static constexpr size_t kMinSamples = 8;
+  static constexpr size_t kHedgePercentile = 95;
+  static constexpr std::chrono::milliseconds kInitialHedgeDelay{1000};
+  static constexpr std::chrono::milliseconds kMinHedgeDelay{50};
+
+  std::mutex mutex_;
+  std::chrono::milliseconds samples_[kSamples] = {};
+  size_t next_ = 0;
+  size_t count_ = 0;
+};
+
+// Returns false for outcomes suggesting the endpoint itself is in trouble, as
+// opposed to it rejecting the request.
+bool IsHealthy(int err, long response_code) {
+  return err == SASL_OK && response_code < 500 && response_code != 429;
+}
+
+std::string GetBreakerOpenError(const std::string &url) {
+  return "Not contacting " + url + " while its circuit breaker is open.";
+}
+
+// A request, and copies of everything it refers to, for HttpPostAsync().
+class AsyncRequest {
+ public:
+  AsyncRequest(const HttpPostOptions &options, HttpCallback done)
+      : url_(options.url),
+        data_(options.data),
+        proxy_(options.proxy),
+        ca_bundle_file_(options.ca_bundle_file),
+        ca_certs_dir_(options.ca_certs_dir),
+        transport_(options.transport),
+        done_(std::move(done)),
+        context_(data_, options.on_data) {}
+
+  // The request's options. Response fields point into |result_|.
+  HttpPostOptions options() {
+    return {.url = url_,
+            .data = data_,
+            .proxy = proxy_,
+            .ca_bundle_file = ca_bundle_file_,
+            .ca_certs_dir = ca_certs_dir_,
+            .response_code = &result_.response_code,
+            .response = &result_.response,
+            .error = &result_.error,
+            .transport = transport_,
+            .timings = &result_.timings};
+  }
+
+  // Returns false, completing the request, if the circuit breaker refuses it.
+  bool Admit() {
+    admitted_ = CircuitBreaker::Allow(url_);
+    if (!admitted_) CompleteWithError(SASL_UNAVAIL, GetBreakerOpenError(url_));
+    return admitted_;
+  }
+
+  // Returns null if the request should be performed synchronously instead.
+  CURL *Prepare() {
+    curl_.emplace(HandlePool::Get(), GetPoolKey(options()));
+    if (!*curl_) return nullptr;
+    ConfigureHandle(curl_->get(), options(), &context_, transport_error_);
+    return curl_->get();
+  }
+
+  void Complete(CURLcode err) {
+    GetTimings(curl_->get(), proxy_, &result_.timings);
+    if (err != CURLE_OK) {
+      result_.err = SASL_BADPROT;
+      result_.error = GetTransportError(err, transport_error_);
+    } else {
+      result_.err = SASL_OK;
+      curl_easy_getinfo(curl_->get(), CURLINFO_RESPONSE_CODE,
+                        &result_.response_code);
+      result_.response = context_.TakeFromServer();
+    }
+    Finish();
+  }
+
+  void CompleteWithError(int err, const std::string &error) {
+    result_.err = err;
+    result_.error = error;
+    Finish();
+  }
+
+  // Completes the request as not attempted, without recording it against the
+  // endpoint.
+  void Cancel() {
+    admitted_ = false;
+    CompleteWithError(SASL_UNAVAIL, "Request cancelled by shutdown.");
+  }
+
+  void CompleteWithIntercept() {
+    result_.err = s_intercept(options());
+    Finish();
+  }
+
+ private:
+  void Finish() {
+    if (admitted_) {
+      CircuitBreaker::Record(url_,
+                             IsHealthy(result_.err, result_.response_code));
+    }
+    latency_.reset();
+    // Return the handle to the pool before running the callback, which may
+    // well start another request.
+    curl_.reset();
+    done_(result_);
+  }
+
+  const std::string url_;
+  const std::string data_;
+  const std::string proxy_;
+  const std::string ca_bundle_file_;
+  const std::string ca_certs_dir_;
+  const HttpTransportOptions transport_;
+  const HttpCallback done_;
+
+  RequestContext context_;
+  char transport_error_[CURL_ERROR_SIZE] = {'\0'};
+  std::optional<PooledHandle> curl_;
+  HttpResult result_;
+  bool admitted_ = false;
+  std::optional<LatencyRecorder> latency_{std::in_place};
+};
+
+// Runs HttpPostAsync() requests concurrently on one background thread, using
+// a curl multi handle. The thread exits when there's nothing left to do, and
+// is restarted by the next request.
+class AsyncEngine {
+ public:
+  static AsyncEngine *Get() {
+    // Intentionally leaked, like HandlePool.
+    static AsyncEngine *s_engine = new AsyncEngine();
+    return s_engine;
+  }
+
+  void Start(std::unique_ptr<AsyncRequest> request) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.push_back(std::move(request));
+    if (!running_) {
+      // A thread that has stopped running has (nearly) returned.
+      if (thread_.joinable()) thread_.join();
+      running_ = true;
+      thread_ = std::thread(&AsyncEngine::Run, this);
+    } else {
+      Wake();
+    }
+  }
+
+  // Cancels all requests, and waits for the thread to exit.
+  void Stop() {
+    std::thread thread;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      Wake();
+      thread.swap(thread_);
+    }
+    if (thread.joinable()) thread.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = false;
+  }
+
+ private:
+  AsyncEngine() : multi_(curl_multi_init()) {}
+
+  void Wake() {
+#if LIBCURL_VERSION_NUM >= 0x074400  // 7.68.0
+    if (multi_) curl_multi_wakeup(multi_);
+#endif
+  }
+
+  void Run() {
+    for (;;) {
+      std::vector<std::unique_ptr<AsyncRequest>> pending;
+      bool stopping = false;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending.swap(pending_);
+        stopping = stopping_;
+        if (pending.empty() && active_.empty()) {
+          running_ = false;
+          return;
+        }
+      }
+
+      if (stopping) {
+        // Callbacks may queue more requests, which are cancelled in turn.
+        for (auto &request : pending) request->Cancel();
+        for (auto &[curl, request] : active_) {
+          curl_multi_remove_handle(multi_, curl);
+          request->Cancel();
+        }
+        active_.clear();
+        continue;
+      }
+
+      for (auto &request : pending) Add(std::move(request));
+      if (active_.empty()) continue;
+
+      int still_running = 0;
+      curl_multi_perform(multi_, &still_running);
+
+      int queued = 0;
+      while (CURLMsg *message = curl_multi_info_read(multi_, &queued)) {
+        if (message->msg != CURLMSG_DONE) continue;
+        auto it = active_.find(message->easy_handle);
+        if (it == active_.end()) continue;
+        std::unique_ptr<AsyncRequest> request = std::move(it->second);
+        active_.erase(it);
+        curl_multi_remove_handle(multi_, message->easy_handle);
+        request->Complete(message->data.result);
+      }
+
+      if (active_.empty()) continue;
+#if LIBCURL_VERSION_NUM >= 0x074400  // 7.68.0
+      curl_multi_poll(multi_, nullptr, 0, kPollMs, nullptr);
+#else
+      // Without curl_multi_wakeup(), new requests wait for this to time out.
+      curl_multi_wait(multi_, nullptr, 0, kWaitMs, nullptr);
+#endif
+    }
+  }
+
+  void Add(std::unique_ptr<AsyncRequest> request) {
+    if (!request->Admit()) return;
+    if (s_intercept) {
+      request->CompleteWithIntercept();
+      return;
+    }
+    CURL *curl = multi_ ? request->Prepare() : nullptr;
+    if (!curl) {
+      request->CompleteWithError(SASL_BADPROT, "Unable to create CURL handle.");
+      return;
+    }
+    curl_multi_add_handle(multi_, curl);
+    active_.emplace(curl, std::move(request));
+  }
+
+  static constexpr int kPollMs = 1000;
+  static constexpr int kWaitMs = 50;
+
+  CURLM *const multi_;
+
+  std::mutex mutex_;
+  std::thread thread_;
+  bool running_ = false;
+  bool stopping_ = false;
+  std::vector<std::unique_ptr<AsyncRequest>> pending_;
+
+  // Only accessed by the engine thread.
+  std::map<CURL *, std::unique_ptr<AsyncRequest>> active_;
+};
+
+// HttpPost(), minus the circuit breaker.
+int Post(const HttpPostOptions &options) {
+  LatencyRecorder latency;
+  *options.response_code = 0;
+  if (s_intercept) return s_intercept(options);
+
+  options.response->clear();
+
+  HandlePool *pool = HandlePool::Get();
+  PooledHandle curl(pool, GetPoolKey(options));
+  if (!curl) {
+    *options.error = "Unable to create CURL handle.";
+    return SASL_BADPROT;
+  }
+
+  RequestContext context(options.data, options.on_data);
+  char transport_error[CURL_ERROR_SIZE] = {'\0'};
+  ConfigureHandle(curl.get(), options, &context, transport_error);
 
   CURLcode err = curl_easy_perform(curl.get());
+  if (options.timings) GetTimings(curl.get(), options.proxy, options.timings);
 
   if (err != CURLE_OK) {
-    *options.error = transport_error;
-    if (options.error->empty()) {
-      *options.error = curl_easy_strerror(err);
-      *options.error += " (no further error information)";
-    }
+    *options.error = GetTransportError(err, transport_error);
     return SASL_BADPROT;
   }
 
   curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, options.response_code);
-  *options.response = context.from_server();
+  *options.response = context.TakeFromServer();
   return SASL_OK;
 }
 
+struct CURLMDeleter final {
+  void operator()(CURLM *multi) const { curl_multi_cleanup(multi); }
+};
+using UniqueCURLM = std::unique_ptr<CURLM, CURLMDeleter>;
+
+// One of HedgedPost()'s transfers. Abandons the transfer if destroyed before
+// it completes.
+class HedgeAttempt {
+ public:
+  HedgeAttempt(CURLM *multi, const HttpPostOptions &options)
+      : multi_(multi),
+        url_(options.url),
+        proxy_(options.proxy),
+        curl_(HandlePool::Get(), GetPoolKey(options)),
+        // Responses are only passed on once a winner is known.
+        context_(options.data, {}) {
+    if (!curl_) return;
+    ConfigureHandle(curl_.get(), options, &context_, transport_error_);
+    added_ = curl_multi_add_handle(multi_, curl_.get()) == CURLM_OK;
+  }
+
+  ~HedgeAttempt() {
+    if (added_) curl_multi_remove_handle(multi_, curl_.get());
+  }
+
+  bool started() const { return added_; }
+  const std::string &url() const { return url_; }
+  CURL *handle() const { return curl_.get(); }
+  std::chrono::steady_clock::duration elapsed() const {
+    return std::chrono::steady_clock::now() - start_;
+  }
+
+  // Fills in the result of the completed transfer.
+  int Complete(CURLcode err, long *response_code, std::string *response,
+               std::string *error, HttpTimings *timings) {
+    curl_multi_remove_handle(multi_, curl_.get());
+    added_ = false;
+    if (timings) GetTimings(curl_.get(), proxy_, timings);
+    if (err != CURLE_OK) {
+      *response_code = 0;
+      response->clear();
+      *error = GetTransportError(err, transport_error_);
+      return SASL_BADPROT;
+    }
+    curl_easy_getinfo(curl_.get(), CURLINFO_RESPONSE_CODE, response_code);
+    *response = context_.TakeFromServer();
+    error->clear();
+    return SASL_OK;
+  }
+
+ private:
+  CURLM *const multi_;
+  const std::string &url_;
+  const std::string &proxy_;
+  PooledHandle curl_;
+  RequestContext context_;
+  char transport_error_[CURL_ERROR_SIZE] = {'\0'};
+  bool added_ = false;
+  const std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+};
+
+// HttpPost() with options.hedge_urls. Transfers run concurrently on a multi
+// handle, in the calling thread.
+int HedgedPost(const HttpPostOptions &options) {
+  LatencyRecorder latency;
+  *options.response_code = 0;
+  options.response->clear();
+
+  UniqueCURLM multi(curl_multi_init());
+  if (!multi) {
+    *options.error = "Unable to create CURL multi handle.";
+    return SASL_BADPROT;
+  }
+
+  std::vector<const std::string *> urls = {&options.url};
+  for (const std::string &url : *options.hedge_urls) urls.push_back(&url);
+  size_t next_url = 0;
+
+  // Until a response wins, the last failure is what gets reported.
+  int err = SASL_BADPROT;
+  *options.error = "No token endpoint available.";
+
+  std::vector<std::unique_ptr<HedgeAttempt>> attempts;
+  auto start_next = [&]() {
+    while (next_url < urls.size()) {
+      const std::string &url = *urls[next_url++];
+      if (!CircuitBreaker::Allow(url)) {
+        err = SASL_UNAVAIL;
+        *options.error = GetBreakerOpenError(url);
+        continue;
+      }
+      HttpPostOptions attempt_options = {
+          .url = url,
+          .data = options.data,
+          .proxy = options.proxy,
+          .ca_bundle_file = options.ca_bundle_file,
+          .ca_certs_dir = options.ca_certs_dir,
+          .response_code = nullptr,
+          .response = nullptr,
+          .error = nullptr,
+          .transport = options.transport};
+      auto attempt =
+          std::make_unique<HedgeAttempt>(multi.get(), attempt_options);
+      if (!attempt->started()) {
+        err = SASL_BADPROT;
+        *options.error = "Unable to create CURL handle.";
+        continue;
+      }
+      attempts.push_back(std::move(attempt));
+      return true;
+    }
+    return false;
+  };
+
+  const std::chrono::milliseconds hedge_delay =
+      LatencyTracker::Get()->GetHedgeDelay();
+  std::chrono::steady_clock::time_point next_hedge =
+      std::chrono::steady_clock::now() + hedge_delay;
+  if (!start_next()) return err;
+
+  for (;;) {
+    int still_running = 0;
+    curl_multi_perform(multi.get(), &still_running);
+
+    int queued = 0;
+    while (CURLMsg *message = curl_multi_info_read(multi.get(), &queued)) {
+      if (message->msg != CURLMSG_DONE) continue;
+      auto it = std::find_if(attempts.begin(), attempts.end(),
+                             [message](const auto &attempt) {
+                               return attempt->handle() ==
+                                      message->easy_handle;
+                             });
+      if (it == attempts.end()) continue;
+
+      std::unique_ptr<HedgeAttempt> attempt = std::move(*it);
+      attempts.erase(it);
+      err = attempt->Complete(message->data.result, options.response_code,
+                              options.response, options.error,
+                              options.timings);
+      const bool healthy = IsHealthy(err, *options.response_code);
+      CircuitBreaker::Record(attempt->url(), healthy);
+      if (healthy) {
+        LatencyTracker::Get()->Record(attempt->elapsed());
+        // Abandon the others.
+        attempts.clear();
+        if (options.on_data)
+          options.on_data(options.response->data(), options.response->size());
+        return err;
+      }
+    }
+
+    // Don't wait out the hedge delay once everything in flight has failed.
+    const auto now = std::chrono::steady_clock::now();
+    if (attempts.empty() || now >= next_hedge) {
+      if (start_next()) {
+        next_hedge = now + hedge_delay;
+      } else if (attempts.empty()) {
+        return err;
+      }
+    }
+
+    int timeout_ms = kHedgePollMs;
+    if (next_url < urls.size()) {
+      const auto until_hedge =
+          std::chrono::duration_cast<std::chrono::milliseconds>(next_hedge -
+                                                                now);
+      timeout_ms = std::clamp(static_cast<int>(until_hedge.count()), 0,
+                              kHedgePollMs);
+    }
+#if LIBCURL_VERSION_NUM >= 0x074200  // 7.66.0
+    curl_multi_poll(multi.get(), nullptr, 0, timeout_ms, nullptr);
+#else
+    curl_multi_wait(multi.get(), nullptr, 0, timeout_ms, nullptr);
+#endif
+  }
+}
+
+}  // namespace
+
+bool ParseIpFamily(const std::string &value,
+                   HttpTransportOptions::IpFamily *family) {
+  if (value == "any")
+    *family = HttpTransportOptions::IP_FAMILY_ANY;
+  else if (value == "ipv4")
+    *family = HttpTransportOptions::IP_FAMILY_V4;
+  else if (value == "ipv6")
+    *family = HttpTransportOptions::IP_FAMILY_V6;
+  else
+    return false;
+  return true;
+}
+
+std::vector<std::string> ParseUrlList(const std::string &value) {
+  std::vector<std::string> urls;
+  size_t start = 0;
+  while ((start = value.find_first_not_of(" \t\n", start)) !=
+         std::string::npos) {
+    const size_t end = value.find_first_of(" \t\n", start);
+    urls.push_back(value.substr(start, end - start));
+    start = end;
+  }
+  return urls;
+}
+
+void SetHttpInterceptForTesting(HttpIntercept intercept) {
+  s_intercept = intercept;
+}
+
+int HttpPost(HttpPostOptions options) {
+  if (options.hedge_urls && !options.hedge_urls->empty() && !s_intercept)
+    return HedgedPost(options);
+
+  if (!CircuitBreaker::Allow(options.url)) {
+    *options.error = GetBreakerOpenError(options.url);
+    return SASL_UNAVAIL;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  const int err = Post(options);
+  const bool healthy = IsHealthy(err, *options.response_code);
+  CircuitBreaker::Record(options.url, healthy);
+  if (healthy)
+    LatencyTracker::Get()->Record(std::chrono::steady_clock::now() - start);
+  return err;
+}
+
+void HttpPostAsync(const HttpPostOptions &options, HttpCallback done) {
+  AsyncEngine::Get()->Start(
+      std::make_unique<AsyncRequest>(options, std::move(done)));
+}
+
+void StopHttpAsync() { AsyncEngine::Get()->Stop(); }
+
 }  // namespace sasl_xoauth2
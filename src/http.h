@@ -17,11 +17,59 @@
 #ifndef SASL_XOAUTH2_HTTP_H
 #define SASL_XOAUTH2_HTTP_H
 
+#include <chrono>
 #include <functional>
 #include <string>
+#include <vector>
 
 namespace sasl_xoauth2 {
 
+using HttpDataCallback = std::function<void(const char *data, size_t size)>;
+
+// Limits and connection preferences for a request. Zeroes leave curl's
+// defaults in place.
+struct HttpTransportOptions {
+  enum IpFamily {
+    IP_FAMILY_ANY,
+    IP_FAMILY_V4,
+    IP_FAMILY_V6,
+  };
+
+  int connect_timeout = 0;  // seconds
+  int request_timeout = 0;  // seconds, for the whole request
+  // Abort if slower than |low_speed_limit| bytes/second for |low_speed_time|
+  // seconds.
+  int low_speed_limit = 0;
+  int low_speed_time = 0;
+  IpFamily ip_family = IP_FAMILY_ANY;
+  // How long to wait for the preferred address family before also trying the
+  // other (RFC 8305). Requires curl 7.59.0.
+  int happy_eyeballs_timeout_ms = 0;
+};
+
+// Parses "any", "ipv4", or "ipv6".
+bool ParseIpFamily(const std::string &value,
+                   HttpTransportOptions::IpFamily *family);
+
+// Splits a whitespace-separated list of URLs.
+std::vector<std::string> ParseUrlList(const std::string &value);
+
+// Where a request's time went, from curl's timers. Each phase is measured
+// from the start of the request, so e.g. |connect| - |name_lookup| is the TCP
+// handshake. Through a proxy, |connect| is the connection to the proxy, and
+// |app_connect| includes setting up the tunnel through it. Phases a request
+// didn't reach (or skipped, on a reused connection) are zero.
+struct HttpTimings {
+  std::chrono::microseconds name_lookup{0};
+  std::chrono::microseconds connect{0};
+  std::chrono::microseconds app_connect{0};  // TLS handshake done.
+  std::chrono::microseconds pre_transfer{0};
+  std::chrono::microseconds start_transfer{0};  // First response byte.
+  std::chrono::microseconds total{0};
+  bool connection_reused = false;
+  bool proxied = false;
+};
+
 struct HttpPostOptions {
   const std::string &url;
   const std::string &data;
@@ -32,14 +80,48 @@ struct HttpPostOptions {
   long *response_code;
   std::string *response;
   std::string *error;
+
+  HttpTransportOptions transport = {};
+
+  // Equivalent URLs to hedge against a slow |url| with. Each is tried in turn
+  // once the requests before it have failed, or have taken longer than most
+  // recent requests; the first healthy response wins, and the remaining
+  // transfers are abandoned. Only used by HttpPost().
+  const std::vector<std::string> *hedge_urls = nullptr;
+
+  // If set, also called with each piece of the response body as it arrives.
+  HttpDataCallback on_data = {};
+
+  // If set, filled in with the timings of the request that produced the
+  // response (or, failing that, the last one to fail).
+  HttpTimings *timings = nullptr;
+};
+
+struct HttpResult {
+  int err = 0;
+  long response_code = 0;
+  std::string response;
+  std::string error;
+  HttpTimings timings;
 };
 
 using HttpIntercept = std::function<int(HttpPostOptions)>;
+using HttpCallback = std::function<void(const HttpResult &)>;
 
 void SetHttpInterceptForTesting(HttpIntercept intercept);
 
 int HttpPost(HttpPostOptions options);
 
+// Like HttpPost(), but returns immediately and calls |done| from a background
+// thread once the request completes. The response fields of |options| are
+// ignored.
+void HttpPostAsync(const HttpPostOptions &options, HttpCallback done);
+
+// Cancels HttpPostAsync() requests still in flight (completing them with
+// SASL_UNAVAIL), and waits for the thread running them to exit. Must be called
+// before the library is unloaded. Later requests start a new thread.
+void StopHttpAsync();
+
 }  // namespace sasl_xoauth2
 
 #endif  // SASL_XOAUTH2_HTTP_H
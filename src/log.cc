@@ -30,8 +30,7 @@ namespace {
 Log::Options s_default_options = Log::OPTIONS_NONE;
 Log::Target s_default_target = Log::TARGET_SYSLOG;
 
-std::string Now() {
-  time_t t = time(nullptr);
+std::string FormatTime(time_t t) {
   char time_str[32];
   tm local_time = {};
   localtime_r(&t, &local_time);
@@ -100,42 +99,94 @@ Log::~Log() {
 void Log::Write(const char *fmt, ...) {
   va_list args;
 
-  va_start(args, fmt);
-  int buf_len = vsnprintf(nullptr, 0, fmt, args);
-  va_end(args);
+  if (options_ & OPTIONS_IMMEDIATE) {
+    va_start(args, fmt);
+    int buf_len = vsnprintf(nullptr, 0, fmt, args);
+    va_end(args);
+
+    // +1 for the trailing \0.
+    std::vector<char> buf(buf_len + 1);
+    va_start(args, fmt);
+    vsnprintf(buf.data(), buf.size(), fmt, args);
+    va_end(args);
+
+    impl_->WriteLine(std::string(buf.data(), buf_len));
+    return;
+  }
 
-  // +1 for the trailing \0.
-  std::vector<char> buf(buf_len + 1);
   va_start(args, fmt);
-  vsnprintf(buf.data(), buf.size(), fmt, args);
+  Append(fmt, args);
   va_end(args);
-
-  const std::string line(buf.begin(), buf.end());
-  if (options_ & OPTIONS_IMMEDIATE) {
-    impl_->WriteLine(line);
-  } else {
-    lines_.push_back(Now() + ": " + line);
-  }
 }
 
 void Log::Flush() {
-  if (lines_.empty()) return;
+  if (num_lines_ == 0) return;
   if (options_ & OPTIONS_FULL_TRACE_ON_FAILURE) {
     impl_->WriteLine("auth failed:");
-    for (const auto &line : lines_) impl_->WriteLine("  " + line);
+    for (size_t i = 0; i < num_lines_; i++)
+      impl_->WriteLine("  " + Render(GetLine(i)));
   } else {
-    if (summary_.empty()) summary_ = lines_.back();
-    impl_->WriteLine("auth failed: " + summary_);
-    if (lines_.size() > 1) {
+    if (summary_ == 0) summary_ = num_lines_;
+    impl_->WriteLine("auth failed: " + Render(GetLine(summary_ - 1)));
+    if (num_lines_ > 1) {
       impl_->WriteLine("set log_full_trace_on_failure to see full " +
-                       std::to_string(lines_.size()) + " line(s) of tracing.");
+                       std::to_string(num_lines_) + " line(s) of tracing.");
     }
   }
 }
 
 void Log::SetFlushOnDestroy() {
   options_ = static_cast<Options>(options_ | OPTIONS_FLUSH_ON_DESTROY);
-  if (!lines_.empty()) summary_ = lines_.back();
+  if (num_lines_ > 0) summary_ = num_lines_;
+}
+
+void Log::Reset(Options options) {
+  if (options_ & OPTIONS_FLUSH_ON_DESTROY) Flush();
+  options_ = static_cast<Options>(options | s_default_options);
+  summary_ = 0;
+  num_lines_ = 0;
+  overflow_lines_.clear();
+  arena_used_ = 0;
+  spilled_.clear();
+}
+
+void Log::Append(const char *fmt, va_list args) {
+  Line line = {time(nullptr), nullptr};
+
+  va_list args_copy;
+  va_copy(args_copy, args);
+  const size_t available = kArenaSize - arena_used_;
+  char *next = arena_ + arena_used_;
+  const int len = vsnprintf(next, available, fmt, args_copy);
+  va_end(args_copy);
+  if (len < 0) return;
+
+  if (static_cast<size_t>(len) < available) {
+    // +1 for the trailing \0.
+    arena_used_ += len + 1;
+    line.text = next;
+  } else {
+    // Doesn't fit in what's left of the arena; format it again on the heap.
+    // Either way the line is never truncated.
+    spilled_.emplace_back(new char[len + 1]);
+    vsnprintf(spilled_.back().get(), len + 1, fmt, args);
+    line.text = spilled_.back().get();
+  }
+
+  if (num_lines_ < kMaxInlineLines)
+    inline_lines_[num_lines_] = line;
+  else
+    overflow_lines_.push_back(line);
+  num_lines_++;
+}
+
+const Log::Line &Log::GetLine(size_t index) const {
+  if (index < kMaxInlineLines) return inline_lines_[index];
+  return overflow_lines_[index - kMaxInlineLines];
+}
+
+std::string Log::Render(const Line &line) const {
+  return FormatTime(line.time) + ": " + line.text;
 }
 
 }  // namespace sasl_xoauth2
@@ -17,6 +17,10 @@
 #ifndef SASL_XOAUTH2_LOG_H
 #define SASL_XOAUTH2_LOG_H
 
+#include <stddef.h>
+#include <stdarg.h>
+#include <time.h>
+
 #include <memory>
 #include <string>
 #include <vector>
@@ -57,17 +61,43 @@ class Log {
   void Write(const char *fmt, ...);
   void Flush();
   void SetFlushOnDestroy();
+  // Ends the current trace as destruction would (flushing it if requested),
+  // then starts a new one with |options|, keeping the buffers for reuse.
+  void Reset(Options options);
 
  protected:
   Log(std::unique_ptr<LogImpl> impl, Options options)
       : impl_(std::move(impl)), options_(options) {}
 
  private:
+  // Buffered lines are formatted into a fixed arena owned by the Log, so that
+  // writing a line (which is usually discarded) doesn't allocate. Timestamps
+  // are only rendered when the buffer is flushed.
+  static constexpr size_t kArenaSize = 16 * 1024;
+  static constexpr size_t kMaxInlineLines = 128;
+
+  struct Line {
+    time_t time;
+    const char *text;
+  };
+
+  void Append(const char *fmt, va_list args);
+  const Line &GetLine(size_t index) const;
+  std::string Render(const Line &line) const;
+
   const std::unique_ptr<LogImpl> impl_;
 
   Options options_;
-  std::string summary_;
-  std::vector<std::string> lines_;
+  size_t summary_ = 0;  // 1 + index of summary line, or 0 if none.
+
+  size_t num_lines_ = 0;
+  Line inline_lines_[kMaxInlineLines];
+  std::vector<Line> overflow_lines_;
+
+  char arena_[kArenaSize];
+  size_t arena_used_ = 0;
+  // Lines that didn't fit in the arena.
+  std::vector<std::unique_ptr<char[]>> spilled_;
 };
 
 }  // namespace sasl_xoauth2
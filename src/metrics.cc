@@ -0,0 +1,244 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+
+#include <sasl/sasl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+
+#include "log.h"
+#include "shared_region.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+// Identifies metrics files, and changes along with kVersion.
+constexpr uint64_t kMagic = 0x73786f6175746832ULL;
+constexpr uint32_t kVersion = 1;
+
+// Upper bounds, in milliseconds, of the latency histogram's buckets. The last
+// bucket is unbounded.
+constexpr uint32_t kLatencyBucketsMs[] = {10,  25,   50,   100,  250,
+                                          500, 1000, 2500, 5000, 10000};
+constexpr size_t kNumLatencyBuckets =
+    sizeof(kLatencyBucketsMs) / sizeof(kLatencyBucketsMs[0]) + 1;
+
+// Counters in the original layout. Later ones are kept at the end of the
+// file, so that files written by earlier versions are simply extended.
+constexpr size_t kNumInitialCounters = Metrics::REFRESHES_DELAYED;
+
+constexpr size_t kMaxTokens = 256;
+constexpr size_t kMaxTokenNameLength = 232;
+
+// Keyed by token file name (see SharedSlotTable).
+struct TokenSlot {
+  std::atomic<uint32_t> state;
+  uint32_t key_length;
+  std::atomic<int64_t> expiry;
+  char key[kMaxTokenNameLength];
+};
+
+static_assert(sizeof(TokenSlot) == 248, "unexpected token slot padding");
+
+// Layout of the shared file. Zero-filled files are valid, empty metrics.
+struct MetricsData {
+  SharedHeader header;
+
+  std::atomic<uint64_t> counters[kNumInitialCounters];
+  std::atomic<uint64_t> latency_buckets[kNumLatencyBuckets];
+  std::atomic<uint64_t> latency_sum_us;
+  std::atomic<uint64_t> latency_count;
+  SharedSlotTable<TokenSlot, kMaxTokens> tokens;
+  std::atomic<uint64_t> later_counters[Metrics::NUM_COUNTERS -
+                                       kNumInitialCounters];
+};
+
+MetricsData *s_metrics = nullptr;
+
+constexpr const char *kCounterNames[Metrics::NUM_COUNTERS][2] = {
+    {"refresh_attempts_total", "Token refresh requests sent."},
+    {"refresh_successes_total", "Token refreshes that succeeded."},
+    {"refresh_failures_total", "Token refreshes that failed."},
+    {"server_retries_total",
+     "Authentications rejected by the server, returning SASL_TRYAGAIN."},
+    {"token_reads_total", "Token file reads."},
+    {"token_writes_total", "Token file writes."},
+    {"refreshes_delayed_total",
+     "Token refreshes that waited for the refresh rate limit."},
+    {"refreshes_throttled_total",
+     "Token refreshes refused by the refresh rate limit."},
+    {"token_cache_hits_total",
+     "Token file reads that used the process's cached contents."},
+    {"token_cache_misses_total",
+     "Token file reads that had to parse the file."},
+};
+
+// Files written before the later counters existed end before them.
+constexpr size_t kMinMetricsSize = offsetof(MetricsData, later_counters);
+
+std::atomic<uint64_t> &GetCounter(MetricsData *data, int counter) {
+  if (counter < static_cast<int>(kNumInitialCounters))
+    return data->counters[counter];
+  return data->later_counters[counter - kNumInitialCounters];
+}
+
+// Returns 0 for counters past the end of a shorter (|size|-byte) file.
+uint64_t ReadCounter(MetricsData *data, size_t size, int counter) {
+  std::atomic<uint64_t> &value = GetCounter(data, counter);
+  const size_t offset =
+      reinterpret_cast<char *>(&value) - reinterpret_cast<char *>(data);
+  return offset + sizeof(value) <= size ? value.load() : 0;
+}
+
+bool CheckHeader(MetricsData *data, bool writable, std::string *error) {
+  if (CheckSharedHeader(&data->header, kMagic, kVersion, writable))
+    return true;
+  *error = "unrecognized metrics file format";
+  return false;
+}
+
+std::string EscapeLabel(const std::string &value) {
+  std::string out;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+void AppendHeader(const char *name, const char *type, const char *help,
+                  std::string *out) {
+  *out += std::string("# HELP sasl_xoauth2_") + name + " " + help + "\n";
+  *out += std::string("# TYPE sasl_xoauth2_") + name + " " + type + "\n";
+}
+
+void AppendSample(const std::string &name, const std::string &labels,
+                  const std::string &value, std::string *out) {
+  *out += "sasl_xoauth2_" + name;
+  if (!labels.empty()) *out += "{" + labels + "}";
+  *out += " " + value + "\n";
+}
+
+}  // namespace
+
+/* static */ int Metrics::Init(const std::string &path) {
+  if (s_metrics || path.empty()) return SASL_OK;
+
+  std::string error;
+  auto region = SharedRegion::Open(path, sizeof(MetricsData),
+                                   /*writable=*/true, &error);
+  auto *data = region ? static_cast<MetricsData *>(region->data()) : nullptr;
+  if (data && !CheckHeader(data, /*writable=*/true, &error)) data = nullptr;
+  if (!data) {
+    auto log = Log::Create(Log::OPTIONS_IMMEDIATE);
+    log->Write("Metrics::Init: %s", error.c_str());
+    return SASL_FAIL;
+  }
+
+  // The mapping lives as long as the process.
+  region.release();
+  s_metrics = data;
+  return SASL_OK;
+}
+
+/* static */ void Metrics::Increment(Counter counter) {
+  if (!s_metrics) return;
+  GetCounter(s_metrics, counter).fetch_add(1, std::memory_order_relaxed);
+}
+
+/* static */ void Metrics::RecordHttpLatency(
+    std::chrono::steady_clock::duration latency) {
+  if (!s_metrics) return;
+  const auto us =
+      std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+  size_t bucket = 0;
+  while (bucket < kNumLatencyBuckets - 1 &&
+         us > static_cast<int64_t>(kLatencyBucketsMs[bucket]) * 1000)
+    bucket++;
+  s_metrics->latency_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  s_metrics->latency_sum_us.fetch_add(us, std::memory_order_relaxed);
+  s_metrics->latency_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* static */ void Metrics::SetTokenExpiry(const std::string &token,
+                                          time_t expiry) {
+  if (!s_metrics) return;
+  TokenSlot *slot = s_metrics->tokens.Find(token, /*claim=*/true);
+  if (slot) slot->expiry.store(expiry, std::memory_order_relaxed);
+}
+
+/* static */ int Metrics::Render(const std::string &path, std::string *out,
+                                 std::string *error) {
+  // An older file isn't extended until a writer opens it.
+  auto region = SharedRegion::OpenPrefix(path, kMinMetricsSize,
+                                         sizeof(MetricsData), error);
+  if (!region) return SASL_FAIL;
+  auto *data = static_cast<MetricsData *>(region->data());
+  if (!CheckHeader(data, /*writable=*/false, error)) return SASL_FAIL;
+
+  out->clear();
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    AppendHeader(kCounterNames[i][0], "counter", kCounterNames[i][1], out);
+    AppendSample(kCounterNames[i][0], "",
+                 std::to_string(ReadCounter(data, region->size(), i)), out);
+  }
+
+  AppendHeader("http_request_duration_seconds", "histogram",
+               "Token endpoint request latency.", out);
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < kNumLatencyBuckets; i++) {
+    cumulative += data->latency_buckets[i].load();
+    char le[32];
+    if (i < kNumLatencyBuckets - 1)
+      snprintf(le, sizeof(le), "%g", kLatencyBucketsMs[i] / 1000.0);
+    else
+      snprintf(le, sizeof(le), "+Inf");
+    AppendSample("http_request_duration_seconds_bucket",
+                 std::string("le=\"") + le + "\"", std::to_string(cumulative),
+                 out);
+  }
+  char sum[32];
+  snprintf(sum, sizeof(sum), "%.6f", data->latency_sum_us.load() / 1e6);
+  AppendSample("http_request_duration_seconds_sum", "", sum, out);
+  AppendSample("http_request_duration_seconds_count", "",
+               std::to_string(data->latency_count.load()), out);
+
+  AppendHeader("token_expiry_seconds", "gauge",
+               "Seconds until the token's access token expires.", out);
+  const time_t now = time(nullptr);
+  for (const TokenSlot &slot : data->tokens.slots) {
+    if (!data->tokens.HasKey(slot)) continue;
+    const std::string name(slot.key, slot.key_length);
+    AppendSample("token_expiry_seconds",
+                 "token=\"" + EscapeLabel(name) + "\"",
+                 std::to_string(slot.expiry.load() - now), out);
+  }
+
+  return SASL_OK;
+}
+
+}  // namespace sasl_xoauth2
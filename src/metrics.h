@@ -0,0 +1,60 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_METRICS_H
+#define SASL_XOAUTH2_METRICS_H
+
+#include <time.h>
+
+#include <chrono>
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// Counters, an HTTP latency histogram, and per-token expiry gauges, kept in a
+// file shared by every process using the plugin (see SharedRegion). Updates
+// are relaxed atomic operations, and are no-ops unless Init() succeeded.
+class Metrics {
+ public:
+  enum Counter {
+    REFRESH_ATTEMPTS,
+    REFRESH_SUCCESSES,
+    REFRESH_FAILURES,
+    SERVER_RETRIES,  // Authentications that returned SASL_TRYAGAIN.
+    TOKEN_READS,
+    TOKEN_WRITES,
+    REFRESHES_DELAYED,    // Refreshes that waited on the RateLimiter.
+    REFRESHES_THROTTLED,  // Refreshes the RateLimiter refused.
+    TOKEN_CACHE_HITS,     // Token file reads served by the TokenCache.
+    TOKEN_CACHE_MISSES,
+    NUM_COUNTERS,
+  };
+
+  // Maps |path|, creating it if needed. Does nothing if |path| is empty.
+  static int Init(const std::string &path);
+
+  static void Increment(Counter counter);
+  static void RecordHttpLatency(std::chrono::steady_clock::duration latency);
+  static void SetTokenExpiry(const std::string &token, time_t expiry);
+
+  // Renders the metrics in |path| in Prometheus text format.
+  static int Render(const std::string &path, std::string *out,
+                    std::string *error);
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_METRICS_H
@@ -16,20 +16,48 @@
 
 #include <sasl/sasl.h>
 #include <sasl/saslplug.h>
+#include <time.h>
 
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "ca_certificates.h"
+#include "circuit_breaker.h"
 #include "client.h"
 #include "config.h"
+#include "http.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "shared_token_cache.h"
+#include "token_index.h"
 
 namespace {
 
+// Disposed Clients are kept for reuse, so that in the steady state a session
+// allocates (almost) nothing.
+constexpr size_t kMaxPooledClients = 16;
+
+std::mutex s_pool_mutex;
+std::vector<std::unique_ptr<sasl_xoauth2::Client>> s_pool;
+
 int mech_new(void *, sasl_client_params_t *params, void **context) {
-  sasl_xoauth2::Client *client = new sasl_xoauth2::Client();
+  std::unique_ptr<sasl_xoauth2::Client> client;
+  {
+    std::lock_guard<std::mutex> lock(s_pool_mutex);
+    if (!s_pool.empty()) {
+      client = std::move(s_pool.back());
+      s_pool.pop_back();
+    }
+  }
+  if (!client) client.reset(new (std::nothrow) sasl_xoauth2::Client());
   if (!client) {
     params->utils->seterror(params->utils->conn, 0,
                             "Failed to create Client instance.");
     return SASL_NOMEM;
   }
-  *context = client;
+  *context = client.release();
   return SASL_OK;
 }
 
@@ -45,7 +73,52 @@ int mech_step(void *context, sasl_client_params_t *params,
 
 void mech_dispose(void *context, const sasl_utils_t *utils) {
   if (!context) return;
-  delete static_cast<sasl_xoauth2::Client *>(context);
+  std::unique_ptr<sasl_xoauth2::Client> client(
+      static_cast<sasl_xoauth2::Client *>(context));
+  client->Reset();
+
+  std::lock_guard<std::mutex> lock(s_pool_mutex);
+  if (s_pool.size() < kMaxPooledClients) s_pool.push_back(std::move(client));
+}
+
+// Called when the plugin is unloaded (by sasl_client_done(), say). Stops the
+// background thread, which would otherwise outlive the code it runs.
+void mech_free(void *, const sasl_utils_t *) {
+  sasl_xoauth2::StopHttpAsync();
+}
+
+// Called (via sasl_idle()) when the application has nothing better to do.
+// Refreshes tokens that pooled Clients kept from earlier sessions if they are
+// about to expire, so that the next session needn't wait on the refresh.
+// Returns 1 if it did any work.
+int idle(void *, void *, sasl_client_params_t *) {
+  sasl_xoauth2::Config::MaybeReload();
+  const sasl_xoauth2::Config *config = sasl_xoauth2::Config::Get();
+  if (config->idle_refresh_margin() <= 0) return 0;
+
+  // Work outside the lock, so that sessions starting meanwhile aren't held up
+  // (they get new Clients instead).
+  std::vector<std::unique_ptr<sasl_xoauth2::Client>> clients;
+  {
+    std::lock_guard<std::mutex> lock(s_pool_mutex);
+    clients.swap(s_pool);
+  }
+
+  const time_t deadline = time(nullptr) + config->idle_refresh_timeout();
+  bool refreshed = false;
+  for (auto &client : clients) {
+    const time_t remaining = deadline - time(nullptr);
+    if (remaining <= 0) break;
+    if (client->RefreshIdleToken(config->idle_refresh_margin(), remaining))
+      refreshed = true;
+  }
+
+  std::lock_guard<std::mutex> lock(s_pool_mutex);
+  for (auto &client : clients) {
+    if (s_pool.size() >= kMaxPooledClients) break;
+    s_pool.push_back(std::move(client));
+  }
+  return refreshed ? 1 : 0;
 }
 
 sasl_client_plug_t s_plugin = {
@@ -59,8 +132,8 @@ sasl_client_plug_t s_plugin = {
     /* mech_new = */ &mech_new,
     /* mech_step = */ &mech_step,
     /* mech_dispose = */ &mech_dispose,
-    /* mech_free = */ nullptr,
-    /* idle = */ nullptr,
+    /* mech_free = */ &mech_free,
+    /* idle = */ &idle,
     /* spare_fptr1 = */ nullptr,
     /* spare_fptr2 = */ nullptr};
 
@@ -83,6 +156,32 @@ extern "C" int sasl_client_plug_init(const sasl_utils_t *utils, int max_version,
   int err = sasl_xoauth2::Config::Init();
   if (err != SASL_OK) return err;
 
+  const std::string token_directory =
+      sasl_xoauth2::Config::Get()->token_directory();
+  if (!token_directory.empty()) {
+    err = sasl_xoauth2::TokenIndex::Init(token_directory);
+    if (err != SASL_OK) {
+      utils->seterror(utils->conn, 0,
+                      "sasl-xoauth2: unable to index token directory %s",
+                      token_directory.c_str());
+      return err;
+    }
+  }
+
+  // Metrics are best-effort; Metrics::Init() logs its own failures.
+  sasl_xoauth2::Metrics::Init(sasl_xoauth2::Config::Get()->metrics_file());
+  // As are the shared token cache, circuit breakers, and rate limiter.
+  sasl_xoauth2::SharedTokenCache::Init(
+      sasl_xoauth2::Config::Get()->shared_token_cache());
+  sasl_xoauth2::CircuitBreaker::Init(
+      sasl_xoauth2::Config::Get()->circuit_breaker_file());
+  sasl_xoauth2::RateLimiter::Init(
+      sasl_xoauth2::Config::Get()->refresh_rate_limit_file());
+  // Without these, curl reads CA certificates from (chroot-relative) paths.
+  sasl_xoauth2::CaCertificates::Init(
+      sasl_xoauth2::Config::Get()->ca_bundle_file(),
+      sasl_xoauth2::Config::Get()->ca_certs_dir());
+
   *out_version = SASL_CLIENT_PLUG_VERSION;
   *plug_list = s_plugins;
   *plug_count = sizeof(s_plugins) / sizeof(s_plugins[0]);
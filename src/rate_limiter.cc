@@ -0,0 +1,140 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "rate_limiter.h"
+
+#include <sasl/sasl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "log.h"
+#include "metrics.h"
+#include "shared_region.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+// Identifies rate limiter files, and changes along with kVersion.
+constexpr uint64_t kMagic = 0x73786f617574726cULL;
+constexpr uint32_t kVersion = 1;
+
+constexpr size_t kMaxBuckets = 64;
+constexpr size_t kMaxKeyLength = 384;
+
+struct BucketSlot {
+  // Keyed by token endpoint and client (see SharedSlotTable).
+  std::atomic<uint32_t> state;
+  uint32_t key_length;
+  char key[kMaxKeyLength];
+
+  // When the bucket will be full again, in CLOCK_MONOTONIC milliseconds.
+  std::atomic<int64_t> full_at;
+};
+
+// Layout of the shared file. Zero-filled files are valid, with all buckets
+// full.
+struct LimiterData {
+  SharedHeader header;
+  SharedSlotTable<BucketSlot, kMaxBuckets> buckets;
+};
+
+// The mapping lives as long as the process (or until ResetForTesting()).
+SharedRegion *s_region = nullptr;
+LimiterData *s_limiter = nullptr;
+
+// Shared by every process on the machine, unlike steady_clock's epoch.
+int64_t NowMs() {
+  timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+}  // namespace
+
+/* static */ int RateLimiter::Init(const std::string &path) {
+  if (s_limiter || path.empty()) return SASL_OK;
+
+  std::string error;
+  auto region = SharedRegion::Open(path, sizeof(LimiterData),
+                                   /*writable=*/true, &error);
+  auto *data = region ? static_cast<LimiterData *>(region->data()) : nullptr;
+  if (data && !CheckSharedHeader(&data->header, kMagic, kVersion,
+                                 /*writable=*/true)) {
+    error = "unrecognized rate limiter file format";
+    data = nullptr;
+  }
+  if (!data) {
+    auto log = Log::Create(Log::OPTIONS_IMMEDIATE);
+    log->Write("RateLimiter::Init: %s", error.c_str());
+    return SASL_FAIL;
+  }
+
+  s_region = region.release();
+  s_limiter = data;
+  return SASL_OK;
+}
+
+/* static */ bool RateLimiter::Acquire(const std::string &key, int rate,
+                                       int burst,
+                                       std::chrono::milliseconds max_wait) {
+  if (rate <= 0) return true;
+  BucketSlot *slot =
+      s_limiter ? s_limiter->buckets.Find(key, /*claim=*/true) : nullptr;
+  if (!slot) return true;
+
+  // Each token pushes full_at back by |interval|; the bucket is empty once
+  // full_at is more than |capacity| ahead.
+  const int64_t interval = std::max<int64_t>(60000 / rate, 1);
+  const int64_t capacity = interval * std::max(burst, 1);
+  const int64_t deadline = NowMs() + max_wait.count();
+  bool waited = false;
+  for (;;) {
+    const int64_t now = NowMs();
+    int64_t full_at = slot->full_at.load(std::memory_order_acquire);
+    // Further ahead than possible: the clock restarted (after a reboot), or
+    // the rate changed. Start over with a full bucket.
+    int64_t next = (full_at > now + capacity) ? now : std::max(full_at, now);
+    next += interval;
+
+    const int64_t wait = next - capacity - now;
+    if (wait > 0) {
+      if (now + wait > deadline) {
+        Metrics::Increment(Metrics::REFRESHES_THROTTLED);
+        return false;
+      }
+      waited = true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+      continue;
+    }
+    if (slot->full_at.compare_exchange_weak(full_at, next,
+                                            std::memory_order_acq_rel)) {
+      if (waited) Metrics::Increment(Metrics::REFRESHES_DELAYED);
+      return true;
+    }
+  }
+}
+
+/* static */ void RateLimiter::ResetForTesting() {
+  delete s_region;
+  s_region = nullptr;
+  s_limiter = nullptr;
+}
+
+}  // namespace sasl_xoauth2
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_RATE_LIMITER_H
+#define SASL_XOAUTH2_RATE_LIMITER_H
+
+#include <chrono>
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// Token buckets limiting refreshes per token endpoint and client, kept in a
+// file shared by every process using the plugin (see SharedRegion), so that a
+// burst of refreshes across processes doesn't trip the provider's throttling.
+//
+// Each bucket is stored as the time at which it will be full again (the
+// generic cell rate algorithm, which is equivalent to a token bucket), so
+// taking a token is a single compare-and-swap.
+//
+// Everything is allowed unless Init() succeeded.
+class RateLimiter {
+ public:
+  // Maps |path|, creating it if needed. Does nothing if |path| is empty.
+  static int Init(const std::string &path);
+
+  // Takes a token from |key|'s bucket, which refills at |rate| tokens per
+  // minute and holds up to |burst|. If it's empty, waits up to |max_wait| for
+  // a token, and returns false if that isn't long enough.
+  static bool Acquire(const std::string &key, int rate, int burst,
+                      std::chrono::milliseconds max_wait);
+
+  static void ResetForTesting();
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_RATE_LIMITER_H
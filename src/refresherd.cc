@@ -0,0 +1,236 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <sasl/sasl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <random>
+#include <string>
+
+#include "config.h"
+#include "log.h"
+#include "token_store.h"
+
+namespace {
+
+struct Options {
+  std::string config_path;
+  std::string token_dir;
+  int margin = 300;   // seconds
+  int jitter = 60;    // seconds
+  int interval = 30;  // seconds
+  bool once = false;
+};
+
+bool TryParseInt(const char *in, int *out) {
+  char *end = nullptr;
+  long value = strtol(in, &end, 10);
+  if (!*in || *end || value < 0 || value > INT32_MAX) return false;
+  *out = static_cast<int>(value);
+  return true;
+}
+
+bool TryParseCommandLine(int argc, char **argv, Options *out) {
+  const char *kShortOptions = "c:d:m:j:i:1";
+  const option kLongOptions[] = {{"config", required_argument, nullptr, 'c'},
+                                 {"dir", required_argument, nullptr, 'd'},
+                                 {"margin", required_argument, nullptr, 'm'},
+                                 {"jitter", required_argument, nullptr, 'j'},
+                                 {"interval", required_argument, nullptr, 'i'},
+                                 {"once", no_argument, nullptr, '1'},
+                                 {nullptr, 0, nullptr, 0}};
+
+  while (true) {
+    int opt = getopt_long(argc, argv, kShortOptions, kLongOptions, nullptr);
+    if (opt == -1) break;
+
+    switch (opt) {
+      case 'c':
+        out->config_path = optarg;
+        break;
+
+      case 'd':
+        out->token_dir = optarg;
+        break;
+
+      case 'm':
+        if (!TryParseInt(optarg, &out->margin)) return false;
+        break;
+
+      case 'j':
+        if (!TryParseInt(optarg, &out->jitter)) return false;
+        break;
+
+      case 'i':
+        if (!TryParseInt(optarg, &out->interval)) return false;
+        if (out->interval == 0) return false;
+        break;
+
+      case '1':
+        out->once = true;
+        break;
+
+      default:
+        return false;
+    }
+  }
+
+  return !out->token_dir.empty();
+}
+
+void PrintUsage(const std::string &base_name) {
+  fprintf(stderr,
+          "Usage: %s --dir=<directory> [options]\n\n"
+          "Keeps the token files in <directory> fresh by refreshing each one\n"
+          "shortly before it expires.\n\n"
+          "Options:\n"
+          "  -c, --config=<file>   use <file> for configuration rather than\n"
+          "                        system default\n"
+          "  -d, --dir=<dir>       directory containing token files\n"
+          "  -m, --margin=<sec>    refresh tokens this many seconds before\n"
+          "                        they expire (default: 300)\n"
+          "  -j, --jitter=<sec>    add up to this many seconds, chosen at\n"
+          "                        random per token, to the margin\n"
+          "                        (default: 60)\n"
+          "  -i, --interval=<sec>  rescan the directory this often\n"
+          "                        (default: 30)\n"
+          "  -1, --once            scan once and exit\n",
+          base_name.c_str());
+}
+
+Options ParseCommandLine(int argc, char **argv) {
+  const std::string base_name = basename(argv[0]);
+  Options parsed_options;
+
+  if (!TryParseCommandLine(argc, argv, &parsed_options)) {
+    PrintUsage(base_name);
+    exit(EXIT_FAILURE);
+  }
+
+  return parsed_options;
+}
+
+class Refresher {
+ public:
+  explicit Refresher(const Options &options)
+      : options_(options), random_(std::random_device()()) {}
+
+  // Returns false if the directory couldn't be scanned.
+  bool RefreshDirectory();
+
+ private:
+  void RefreshIfNeeded(const std::string &path);
+  int GetJitter(const std::string &path);
+
+  const Options &options_;
+  std::mt19937 random_;
+
+  // Jitter is chosen once per token so that each token's refresh time is
+  // stable from one scan to the next.
+  std::map<std::string, int> jitter_;
+};
+
+bool Refresher::RefreshDirectory() {
+  DIR *dir = opendir(options_.token_dir.c_str());
+  if (!dir) {
+    fprintf(stderr, "Unable to open directory %s: %s\n",
+            options_.token_dir.c_str(), strerror(errno));
+    return false;
+  }
+
+  while (const dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') continue;
+    if (sasl_xoauth2::TokenStore::IsAuxiliaryFile(entry->d_name)) continue;
+
+    const std::string path = options_.token_dir + "/" + entry->d_name;
+    struct stat st = {};
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    RefreshIfNeeded(path);
+  }
+
+  closedir(dir);
+  return true;
+}
+
+void Refresher::RefreshIfNeeded(const std::string &path) {
+  auto logger = sasl_xoauth2::Log::Create(
+      sasl_xoauth2::Log::OPTIONS_FULL_TRACE_ON_FAILURE,
+      sasl_xoauth2::Log::TARGET_STDERR);
+  auto token_store = sasl_xoauth2::TokenStore::Create(logger.get(), path);
+  if (!token_store) {
+    logger->Flush();
+    fprintf(stderr, "Failed to read token %s.\n", path.c_str());
+    return;
+  }
+
+  const time_t remaining = token_store->expiry() - time(nullptr);
+  if (remaining > options_.margin + GetJitter(path)) return;
+
+  if (token_store->Refresh() != SASL_OK) {
+    logger->Flush();
+    fprintf(stderr, "Token refresh failed for %s.\n", path.c_str());
+    return;
+  }
+
+  // Pick a new jitter for the next time around.
+  jitter_.erase(path);
+  fprintf(stderr, "Refreshed %s, now expires in %ld second(s).\n",
+          path.c_str(),
+          static_cast<long>(token_store->expiry() - time(nullptr)));
+}
+
+int Refresher::GetJitter(const std::string &path) {
+  auto it = jitter_.find(path);
+  if (it != jitter_.end()) return it->second;
+  std::uniform_int_distribution<int> dist(0, options_.jitter);
+  const int jitter = dist(random_);
+  jitter_[path] = jitter;
+  return jitter;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const Options options = ParseCommandLine(argc, argv);
+
+  sasl_xoauth2::Config::EnableLoggingToStderr();
+  if (sasl_xoauth2::Config::Init(options.config_path) != SASL_OK) {
+    fprintf(stderr, "Config check failed.\n");
+    return EXIT_FAILURE;
+  }
+
+  // Reload the config on SIGHUP (and whenever it changes).
+  signal(SIGHUP, [](int) { sasl_xoauth2::Config::RequestReload(); });
+
+  Refresher refresher(options);
+  while (true) {
+    sasl_xoauth2::Config::MaybeReload();
+    if (!refresher.RefreshDirectory() && options.once) return EXIT_FAILURE;
+    if (options.once) break;
+    sleep(options.interval);
+  }
+
+  return EXIT_SUCCESS;
+}
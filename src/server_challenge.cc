@@ -0,0 +1,116 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server_challenge.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+class Scanner {
+ public:
+  Scanner(const char *data, size_t size) : p_(data), end_(data + size) {}
+
+  bool AtEnd() const { return p_ == end_; }
+
+  void SkipSpace() {
+    while (p_ < end_ &&
+           (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r'))
+      p_++;
+  }
+
+  bool Expect(char c) {
+    SkipSpace();
+    if (p_ == end_ || *p_ != c) return false;
+    p_++;
+    return true;
+  }
+
+  bool Peek(char c) {
+    SkipSpace();
+    return p_ < end_ && *p_ == c;
+  }
+
+  // Reads a string without escapes, or a bare number/true/false/null. null
+  // reads as empty, as jsoncpp's asString() would have it.
+  bool Value(std::string_view *value) {
+    SkipSpace();
+    if (p_ == end_) return false;
+    if (*p_ == '"') return String(value);
+
+    const char *start = p_;
+    while (p_ < end_ && IsBareChar(*p_)) p_++;
+    if (p_ == start) return false;
+    *value = std::string_view(start, p_ - start);
+    if (*value == "null") *value = {};
+    return true;
+  }
+
+  bool String(std::string_view *value) {
+    if (!Expect('"')) return false;
+    const char *start = p_;
+    while (p_ < end_ && *p_ != '"') {
+      // Escapes would need unescaping into a copy; leave those to jsoncpp.
+      if (*p_ == '\\' || static_cast<unsigned char>(*p_) < 0x20) return false;
+      p_++;
+    }
+    if (p_ == end_) return false;
+    *value = std::string_view(start, p_ - start);
+    p_++;
+    return true;
+  }
+
+ private:
+  static bool IsBareChar(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' ||
+           c == '+' || c == '.' || c == 'E';
+  }
+
+  const char *p_;
+  const char *end_;
+};
+
+}  // namespace
+
+bool ScanServerChallenge(const char *data, size_t size,
+                         ServerChallenge *challenge) {
+  *challenge = {};
+  // SASL implementations commonly count the C string terminator.
+  if (size > 0 && data[size - 1] == '\0') size--;
+
+  Scanner scanner(data, size);
+  if (!scanner.Expect('{')) return false;
+
+  if (!scanner.Peek('}')) {
+    do {
+      std::string_view key, value;
+      if (!scanner.String(&key) || !scanner.Expect(':') ||
+          !scanner.Value(&value))
+        return false;
+
+      if (key == "status")
+        challenge->status = value;
+      else if (key == "schemes")
+        challenge->schemes = value;
+      else if (key == "scope")
+        challenge->scope = value;
+    } while (scanner.Expect(','));
+  }
+
+  if (!scanner.Expect('}')) return false;
+  scanner.SkipSpace();
+  return scanner.AtEnd();
+}
+
+}  // namespace sasl_xoauth2
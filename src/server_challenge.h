@@ -0,0 +1,44 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_SERVER_CHALLENGE_H
+#define SASL_XOAUTH2_SERVER_CHALLENGE_H
+
+#include <stddef.h>
+
+#include <string_view>
+
+namespace sasl_xoauth2 {
+
+// The JSON error a server sends after rejecting an XOAUTH2 token, e.g.
+//   {"status":"401","schemes":"Bearer","scope":"https://mail.google.com/"}
+// Fields point into the buffer that was scanned, and are empty if absent.
+struct ServerChallenge {
+  std::string_view status;
+  std::string_view schemes;
+  std::string_view scope;
+};
+
+// Scans |data| (which may carry a trailing NUL) in place. Values must be
+// strings without escapes, or bare numbers/literals; anything else -- escapes,
+// nested values, malformed JSON -- returns false, and callers should fall back
+// to a full JSON parser.
+bool ScanServerChallenge(const char *data, size_t size,
+                         ServerChallenge *challenge);
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_SERVER_CHALLENGE_H
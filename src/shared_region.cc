@@ -0,0 +1,170 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shared_region.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+// Left by earlier versions while claiming a slot. Only a crash could leave one
+// in place for long, so they're always taken over.
+constexpr uint32_t kLegacyClaimed = 1;
+// Claims are stamped with the (CLOCK_MONOTONIC) second they were made, offset
+// past the other states, so that one left by a process that died mid-claim
+// can be taken over rather than leaking the slot.
+constexpr uint32_t kClaimedBase = 3;
+constexpr int64_t kStaleClaimSeconds = 60;
+
+uint32_t ClaimStamp() { return kClaimedBase + SharedHoldStamp(); }
+
+bool IsStaleClaim(uint32_t state) {
+  return state == kLegacyClaimed || IsStaleHoldStamp(state - kClaimedBase);
+}
+
+}  // namespace
+
+uint32_t SharedHoldStamp() {
+  timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint32_t>(ts.tv_sec % (UINT32_MAX - kClaimedBase));
+}
+
+bool IsStaleHoldStamp(uint32_t stamp) {
+  // A stamp from the future was taken before a reboot.
+  const int64_t age = static_cast<int64_t>(SharedHoldStamp()) -
+                      static_cast<int64_t>(stamp);
+  return age < 0 || age > kStaleClaimSeconds;
+}
+
+bool CheckSharedHeader(SharedHeader *header, uint64_t magic, uint32_t version,
+                       bool writable) {
+  uint64_t current = header->magic.load(std::memory_order_acquire);
+  if (current == 0 && writable) {
+    header->version = version;
+    if (header->magic.compare_exchange_strong(current, magic,
+                                              std::memory_order_acq_rel))
+      current = magic;
+  }
+  return current == magic && header->version == version;
+}
+
+SharedSlotMatch MatchSharedSlot(std::atomic<uint32_t> *state,
+                                uint32_t *key_length, char *key,
+                                size_t max_key_length, const std::string &wanted,
+                                bool claim) {
+  if (wanted.size() > max_key_length) return SharedSlotMatch::ABSENT;
+  uint32_t current = state->load(std::memory_order_acquire);
+  if (current == SHARED_SLOT_READY) {
+    return (*key_length == wanted.size() &&
+            memcmp(key, wanted.data(), wanted.size()) == 0)
+               ? SharedSlotMatch::FOUND
+               : SharedSlotMatch::OTHER;
+  }
+  // A slot being claimed may be for any key, so keep looking.
+  if (current != SHARED_SLOT_EMPTY && !IsStaleClaim(current))
+    return SharedSlotMatch::OTHER;
+  if (!claim) {
+    return current == SHARED_SLOT_EMPTY ? SharedSlotMatch::ABSENT
+                                        : SharedSlotMatch::OTHER;
+  }
+
+  uint32_t stamp = ClaimStamp();
+  if (!state->compare_exchange_strong(current, stamp,
+                                      std::memory_order_acquire))
+    return SharedSlotMatch::OTHER;
+  memcpy(key, wanted.data(), wanted.size());
+  *key_length = wanted.size();
+  // Fails if the claim took so long that someone else took it over.
+  if (!state->compare_exchange_strong(stamp, SHARED_SLOT_READY,
+                                      std::memory_order_release))
+    return SharedSlotMatch::OTHER;
+  return SharedSlotMatch::FOUND;
+}
+
+/* static */ std::unique_ptr<SharedRegion> SharedRegion::Open(
+    const std::string &path, size_t size, bool writable, std::string *error,
+    mode_t mode) {
+  return Map(path, size, size, writable, error, mode);
+}
+
+/* static */ std::unique_ptr<SharedRegion> SharedRegion::OpenPrefix(
+    const std::string &path, size_t min_size, size_t size,
+    std::string *error) {
+  return Map(path, min_size, size, /*writable=*/false, error, 0644);
+}
+
+/* static */ std::unique_ptr<SharedRegion> SharedRegion::Map(
+    const std::string &path, size_t min_size, size_t size, bool writable,
+    std::string *error, mode_t mode) {
+  const int flags = writable ? (O_RDWR | O_CREAT | O_CLOEXEC)
+                             : (O_RDONLY | O_CLOEXEC);
+  int fd = open(path.c_str(), flags, mode);
+  if (fd < 0) {
+    *error = "unable to open " + path + ": " + strerror(errno);
+    return {};
+  }
+
+  struct stat st = {};
+  if (fstat(fd, &st) != 0) {
+    *error = "unable to stat " + path + ": " + strerror(errno);
+    close(fd);
+    return {};
+  }
+  if (st.st_mode & ~mode & 077) {
+    *error = path + " is accessible to other users";
+    close(fd);
+    return {};
+  }
+  if (!writable && static_cast<size_t>(st.st_size) < size)
+    size = std::max(min_size, static_cast<size_t>(st.st_size));
+  if (static_cast<size_t>(st.st_size) < size) {
+    // Growing the file zero-fills it. Concurrent growers all agree on the
+    // result, so there's no need to lock.
+    if (!writable) {
+      *error = path + " is too small";
+      close(fd);
+      return {};
+    }
+    if (ftruncate(fd, size) != 0) {
+      *error = "unable to extend " + path + ": " + strerror(errno);
+      close(fd);
+      return {};
+    }
+  }
+
+  const int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+  void *data = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    *error = "unable to map " + path + ": " + strerror(errno);
+    return {};
+  }
+
+  return std::unique_ptr<SharedRegion>(new SharedRegion(data, size));
+}
+
+SharedRegion::~SharedRegion() { munmap(data_, size_); }
+
+}  // namespace sasl_xoauth2
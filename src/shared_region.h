@@ -0,0 +1,147 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_SHARED_REGION_H
+#define SASL_XOAUTH2_SHARED_REGION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "hash.h"
+
+namespace sasl_xoauth2 {
+
+// A file mapped into memory shared with every other process that maps it, for
+// state shared between Postfix's smtp processes. Mapping happens once, before
+// any chroot; after that, access is plain memory access.
+class SharedRegion {
+ public:
+  // Maps the first |size| bytes of |path|. If |writable|, the file is created
+  // (and extended with zeros) as needed, with permissions |mode|. An existing
+  // file that grants group or other users more than |mode| does is refused.
+  // Returns null, and sets |error|, on failure.
+  static std::unique_ptr<SharedRegion> Open(const std::string &path,
+                                            size_t size, bool writable,
+                                            std::string *error,
+                                            mode_t mode = 0644);
+  // Maps up to the first |size| bytes of |path| read-only, for files that
+  // earlier versions may have written with a shorter layout. Fails if there
+  // are fewer than |min_size| bytes; size() is how many were mapped.
+  static std::unique_ptr<SharedRegion> OpenPrefix(const std::string &path,
+                                                  size_t min_size, size_t size,
+                                                  std::string *error);
+
+  ~SharedRegion();
+
+  SharedRegion(const SharedRegion &) = delete;
+  SharedRegion &operator=(const SharedRegion &) = delete;
+
+  void *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  SharedRegion(void *data, size_t size) : data_(data), size_(size) {}
+
+  static std::unique_ptr<SharedRegion> Map(const std::string &path,
+                                           size_t min_size, size_t size,
+                                           bool writable, std::string *error,
+                                           mode_t mode);
+
+  void *const data_;
+  const size_t size_;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared atomics must be lock-free");
+
+// Starts every shared file, identifying its format. Zero in a new file.
+struct SharedHeader {
+  std::atomic<uint64_t> magic;
+  uint32_t version;
+  uint32_t reserved;
+};
+
+// Returns true if |header| is for format |magic|, |version|. If |writable|, a
+// new header is stamped with them first; whoever gets there first wins.
+bool CheckSharedHeader(SharedHeader *header, uint64_t magic, uint32_t version,
+                       bool writable);
+
+// For shared state that a process may die holding, such as a slot it is
+// claiming: the current (CLOCK_MONOTONIC) second to stamp it with, and whether
+// a stamp is old enough that its holder is presumed dead and the state may be
+// taken over.
+uint32_t SharedHoldStamp();
+bool IsStaleHoldStamp(uint32_t stamp);
+
+// Values of a SharedSlotTable slot's |state|. Anything else means the slot is
+// being claimed.
+enum SharedSlotState : uint32_t {
+  SHARED_SLOT_EMPTY = 0,
+  SHARED_SLOT_READY = 2,
+};
+
+enum class SharedSlotMatch { FOUND, ABSENT, OTHER };
+
+// SharedSlotTable's per-slot lookup, shared by all instantiations.
+SharedSlotMatch MatchSharedSlot(std::atomic<uint32_t> *state,
+                                uint32_t *key_length, char *key,
+                                size_t max_key_length, const std::string &wanted,
+                                bool claim);
+
+// A fixed-size, open-addressed hash table of |Slot|s in a shared file, keyed by
+// strings. Slots are claimed for a key without locking, and never freed.
+// |Slot| must have these members:
+//   std::atomic<uint32_t> state;  // A SharedSlotState.
+//   uint32_t key_length;
+//   char key[N];
+// The rest of it is the caller's, and zero until first used.
+template <typename Slot, size_t kNumSlots>
+struct SharedSlotTable {
+  // Returns the slot for |key|. If there isn't one, claims a free slot for it
+  // if |claim|, and returns null otherwise. Also returns null if |key| is too
+  // long, or the table is full.
+  Slot *Find(const std::string &key, bool claim) {
+    const size_t start = Fnv1aHash(key) % kNumSlots;
+    for (size_t i = 0; i < kNumSlots; i++) {
+      Slot *slot = &slots[(start + i) % kNumSlots];
+      switch (MatchSharedSlot(&slot->state, &slot->key_length, slot->key,
+                              sizeof(slot->key), key, claim)) {
+        case SharedSlotMatch::FOUND:
+          return slot;
+        case SharedSlotMatch::ABSENT:
+          return nullptr;
+        case SharedSlotMatch::OTHER:
+          break;
+      }
+    }
+    return nullptr;
+  }
+
+  static bool HasKey(const Slot &slot) {
+    return slot.state.load(std::memory_order_acquire) == SHARED_SLOT_READY;
+  }
+
+  Slot slots[kNumSlots];
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_SHARED_REGION_H
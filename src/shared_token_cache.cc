@@ -0,0 +1,173 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shared_token_cache.h"
+
+#include <sasl/sasl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+
+#include "hash.h"
+#include "log.h"
+#include "shared_region.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+// Identifies token cache files, and changes along with kVersion.
+constexpr uint64_t kMagic = 0x73786f6175746b63ULL;
+constexpr uint32_t kVersion = 1;
+
+constexpr size_t kMaxSlots = 128;
+constexpr size_t kMaxKeyLength = 256;
+constexpr size_t kMaxAccessTokenLength = 4096;
+constexpr int kMaxReadAttempts = 16;
+
+struct TokenSlot {
+  // Guards the key, which never changes once READY (see SharedSlotTable).
+  std::atomic<uint32_t> state;
+  uint32_t key_length;
+  char key[kMaxKeyLength];
+
+  // Odd while the fields below are being written, and bumped by two with each
+  // publication. A writer stamps |write_stamp| (see SharedHoldStamp()) once
+  // it has made it odd, so that if it dies mid-update, the next publisher can
+  // take the slot over. Earlier versions left the stamp zero.
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint64_t> refresh_hash;
+  std::atomic<int64_t> expiry;
+  std::atomic<uint32_t> access_length;
+  std::atomic<uint32_t> write_stamp;
+  char access[kMaxAccessTokenLength];
+};
+
+// Layout of the shared file. Zero-filled files are valid, empty caches.
+struct CacheData {
+  SharedHeader header;
+  SharedSlotTable<TokenSlot, kMaxSlots> slots;
+};
+
+// The mapping lives as long as the process (or until ResetForTesting()).
+SharedRegion *s_region = nullptr;
+CacheData *s_cache = nullptr;
+
+}  // namespace
+
+/* static */ int SharedTokenCache::Init(const std::string &path) {
+  if (s_cache || path.empty()) return SASL_OK;
+
+  std::string error;
+  auto region = SharedRegion::Open(path, sizeof(CacheData),
+                                   /*writable=*/true, &error, 0600);
+  auto *data = region ? static_cast<CacheData *>(region->data()) : nullptr;
+  if (data && !CheckSharedHeader(&data->header, kMagic, kVersion,
+                                 /*writable=*/true)) {
+    error = "unrecognized token cache file format";
+    data = nullptr;
+  }
+  if (!data) {
+    auto log = Log::Create(Log::OPTIONS_IMMEDIATE);
+    log->Write("SharedTokenCache::Init: %s", error.c_str());
+    return SASL_FAIL;
+  }
+
+  s_region = region.release();
+  s_cache = data;
+  return SASL_OK;
+}
+
+/* static */ bool SharedTokenCache::Lookup(const std::string &key,
+                                           const std::string &refresh_token,
+                                           std::string *access_token,
+                                           time_t *expiry) {
+  if (!s_cache) return false;
+  TokenSlot *slot = s_cache->slots.Find(key, /*claim=*/false);
+  if (!slot) return false;
+
+  const uint64_t refresh_hash = Fnv1aHash(refresh_token);
+  for (int i = 0; i < kMaxReadAttempts; i++) {
+    const uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if (sequence == 0) return false;  // Never published.
+    if (sequence & 1) continue;
+
+    const size_t length = slot->access_length.load(std::memory_order_relaxed);
+    if (length > kMaxAccessTokenLength) continue;
+    if (slot->refresh_hash.load(std::memory_order_relaxed) != refresh_hash)
+      return false;
+    *expiry = slot->expiry.load(std::memory_order_relaxed);
+    access_token->assign(slot->access, length);
+
+    // Only trust what was copied if no writer started in the meantime.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) == sequence)
+      return true;
+  }
+  return false;
+}
+
+/* static */ void SharedTokenCache::Publish(const std::string &key,
+                                            const std::string &refresh_token,
+                                            const std::string &access_token,
+                                            time_t expiry) {
+  if (!s_cache || access_token.size() > kMaxAccessTokenLength) return;
+  TokenSlot *slot = s_cache->slots.Find(key, /*claim=*/true);
+  if (!slot) return;
+
+  // Concurrent publishers of the same token have equally fresh tokens, so
+  // losing the race is fine. A stale update is taken over by moving on to the
+  // next odd value, so that its writer, if merely slow, can't complete it.
+  uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+  uint64_t writing = sequence + 1;
+  if (sequence & 1) {
+    if (!IsStaleHoldStamp(
+            slot->write_stamp.load(std::memory_order_relaxed)))
+      return;
+    writing = sequence + 2;
+  }
+  if (!slot->sequence.compare_exchange_strong(sequence, writing,
+                                              std::memory_order_acquire))
+    return;
+  slot->write_stamp.store(SharedHoldStamp(), std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->refresh_hash.store(Fnv1aHash(refresh_token), std::memory_order_relaxed);
+  slot->expiry.store(expiry, std::memory_order_relaxed);
+  slot->access_length.store(access_token.size(), std::memory_order_relaxed);
+  memcpy(slot->access, access_token.data(), access_token.size());
+
+  // Fails if this took so long that another publisher took it over.
+  slot->sequence.compare_exchange_strong(writing, writing + 1,
+                                         std::memory_order_release);
+}
+
+/* static */ void SharedTokenCache::AbandonPublishForTesting(
+    const std::string &key, int age) {
+  if (!s_cache) return;
+  TokenSlot *slot = s_cache->slots.Find(key, /*claim=*/true);
+  if (!slot) return;
+  slot->write_stamp.store(SharedHoldStamp() - age);
+  slot->sequence.fetch_or(1);
+}
+
+/* static */ void SharedTokenCache::ResetForTesting() {
+  delete s_region;
+  s_region = nullptr;
+  s_cache = nullptr;
+}
+
+}  // namespace sasl_xoauth2
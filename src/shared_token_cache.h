@@ -0,0 +1,57 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_SHARED_TOKEN_CACHE_H
+#define SASL_XOAUTH2_SHARED_TOKEN_CACHE_H
+
+#include <time.h>
+
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// Access tokens, kept in a file shared by every process using the plugin (see
+// SharedRegion), so that a token refreshed by one process is seen by all of
+// them without re-reading -- or re-refreshing -- the token file. Entries are
+// keyed by token file and tied to the refresh token they were issued for.
+//
+// Each entry is published under a seqlock: readers never block or write, and
+// give up (falling back to the token file) if they keep racing a writer.
+class SharedTokenCache {
+ public:
+  // Maps |path|, creating it (readable only by its owner) if needed. Does
+  // nothing if |path| is empty.
+  static int Init(const std::string &path);
+
+  // Returns true, and sets |access_token| and |expiry|, if a token was
+  // published for |key| and |refresh_token|.
+  static bool Lookup(const std::string &key, const std::string &refresh_token,
+                     std::string *access_token, time_t *expiry);
+  // Does nothing if |key| or |access_token| is too long to share, or if
+  // another process is publishing the same key (unless it has been at it for
+  // so long that it's presumed dead).
+  static void Publish(const std::string &key, const std::string &refresh_token,
+                      const std::string &access_token, time_t expiry);
+
+  // Leaves |key|'s entry as a publisher that died mid-update |age| seconds
+  // ago would.
+  static void AbandonPublishForTesting(const std::string &key, int age);
+  static void ResetForTesting();
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_SHARED_TOKEN_CACHE_H
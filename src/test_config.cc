@@ -5,6 +5,7 @@
 
 #include "config.h"
 #include "log.h"
+#include "metrics.h"
 #include "token_store.h"
 
 namespace {
@@ -12,12 +13,18 @@ namespace {
 struct Options {
   std::string config_path;
   std::string token_path;
+  std::string convert_format;
+  std::string output_path;
+  bool print_metrics = false;
 };
 
 bool TryParseCommandLine(int argc, char **argv, Options *out) {
-  const char *kShortOptions = "c:r:";
+  const char *kShortOptions = "c:r:f:o:m";
   const option kLongOptions[] = {{"config", required_argument, nullptr, 'c'},
                                  {"token", required_argument, nullptr, 'r'},
+                                 {"convert", required_argument, nullptr, 'f'},
+                                 {"output", required_argument, nullptr, 'o'},
+                                 {"metrics", no_argument, nullptr, 'm'},
                                  {nullptr, 0, nullptr, 0}};
 
   while (true) {
@@ -33,11 +40,27 @@ bool TryParseCommandLine(int argc, char **argv, Options *out) {
         out->token_path = optarg;
         break;
 
+      case 'f':
+        out->convert_format = optarg;
+        if (out->convert_format != "json" && out->convert_format != "binary")
+          return false;
+        break;
+
+      case 'o':
+        out->output_path = optarg;
+        break;
+
+      case 'm':
+        out->print_metrics = true;
+        break;
+
       default:
         return false;
     }
   }
 
+  if (!out->convert_format.empty() && out->token_path.empty()) return false;
+  if (out->print_metrics && !out->token_path.empty()) return false;
   return true;
 }
 
@@ -48,7 +71,13 @@ void PrintUsage(const std::string &base_name) {
           "  -c, --config=<file>  use <file> for configuration rather than\n"
           "                       system default\n"
           "  -r, --token=<file>   attempt to request a token from the OAuth\n"
-          "                       provider using the refresh token in <file>\n",
+          "                       provider using the refresh token in <file>\n"
+          "  -f, --convert=<fmt>  rather than refreshing, convert the token\n"
+          "                       in <file> to <fmt> (\"json\" or \"binary\")\n"
+          "  -o, --output=<file>  write the converted token to <file> rather\n"
+          "                       than overwriting the input\n"
+          "  -m, --metrics        print the contents of the configured\n"
+          "                       metrics_file in Prometheus text format\n",
           base_name.c_str());
 }
 
@@ -74,6 +103,23 @@ int main(int argc, char **argv) {
     printf("Config check failed.\n");
     return EXIT_FAILURE;
   }
+
+  // Print nothing else, so that the output can be fed to a collector.
+  if (options.print_metrics) {
+    const std::string path = sasl_xoauth2::Config::Get()->metrics_file();
+    if (path.empty()) {
+      fprintf(stderr, "No metrics_file configured.\n");
+      return EXIT_FAILURE;
+    }
+    std::string metrics, error;
+    if (sasl_xoauth2::Metrics::Render(path, &metrics, &error) != SASL_OK) {
+      fprintf(stderr, "Unable to read metrics: %s\n", error.c_str());
+      return EXIT_FAILURE;
+    }
+    fputs(metrics.c_str(), stdout);
+    return EXIT_SUCCESS;
+  }
+
   printf("Config check passed.\n");
 
   if (!options.token_path.empty()) {
@@ -88,6 +134,21 @@ int main(int argc, char **argv) {
       printf("Failed to read token.\n");
       return EXIT_FAILURE;
     }
+    if (!options.convert_format.empty()) {
+      const auto format = options.convert_format == "binary"
+                              ? sasl_xoauth2::TokenStore::FORMAT_BINARY
+                              : sasl_xoauth2::TokenStore::FORMAT_JSON;
+      const std::string &output_path = options.output_path.empty()
+                                           ? options.token_path
+                                           : options.output_path;
+      if (token_store->Export(output_path, format) != SASL_OK) {
+        logger->Flush();
+        printf("Token conversion failed.\n");
+        return EXIT_FAILURE;
+      }
+      printf("Token converted.\n");
+      return EXIT_SUCCESS;
+    }
     if (token_store->Refresh() != SASL_OK) {
       logger->Flush();
       printf("Token refresh failed.\n");
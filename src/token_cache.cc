@@ -0,0 +1,69 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "token_cache.h"
+
+#include "metrics.h"
+
+namespace sasl_xoauth2 {
+
+TokenCache::FileIdentity::FileIdentity(const struct stat &st)
+    : dev(st.st_dev), ino(st.st_ino), size(st.st_size), mtime(st.st_mtim) {}
+
+bool TokenCache::FileIdentity::operator==(const FileIdentity &other) const {
+  return dev == other.dev && ino == other.ino && size == other.size &&
+         mtime.tv_sec == other.mtime.tv_sec &&
+         mtime.tv_nsec == other.mtime.tv_nsec;
+}
+
+/* static */ TokenCache *TokenCache::Get() {
+  // Intentionally leaked, to avoid destruction-order issues at exit.
+  static TokenCache *s_cache = new TokenCache();
+  return s_cache;
+}
+
+bool TokenCache::Lookup(const std::string &path, const struct stat &st,
+                        Json::Value *root) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(path);
+  if (it == entries_.end() || !(it->second.identity == FileIdentity(st))) {
+    misses_++;
+    Metrics::Increment(Metrics::TOKEN_CACHE_MISSES);
+    return false;
+  }
+  hits_++;
+  Metrics::Increment(Metrics::TOKEN_CACHE_HITS);
+  *root = it->second.root;
+  return true;
+}
+
+void TokenCache::Insert(const std::string &path, const struct stat &st,
+                        const Json::Value &root) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.insert_or_assign(path, Entry{FileIdentity(st), root});
+}
+
+void TokenCache::Invalidate(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.erase(path);
+}
+
+TokenCache::Stats TokenCache::stats() const {
+  Stats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  return stats;
+}
+
+}  // namespace sasl_xoauth2
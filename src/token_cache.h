@@ -0,0 +1,82 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_TOKEN_CACHE_H
+#define SASL_XOAUTH2_TOKEN_CACHE_H
+
+#include <json/json.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// Process-wide cache of parsed token files, keyed by path. Entries are
+// validated against the file's current identity (device, inode, size, and
+// modification time) so that a file replaced or edited by another process is
+// re-read.
+class TokenCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  struct FileIdentity {
+    dev_t dev = 0;
+    ino_t ino = 0;
+    off_t size = 0;
+    timespec mtime = {};
+
+    explicit FileIdentity(const struct stat &st);
+    bool operator==(const FileIdentity &other) const;
+  };
+
+  static TokenCache *Get();
+
+  // Returns true, and populates |root|, if |path| is cached and the cached
+  // entry matches |st|.
+  bool Lookup(const std::string &path, const struct stat &st,
+              Json::Value *root);
+  void Insert(const std::string &path, const struct stat &st,
+              const Json::Value &root);
+  void Invalidate(const std::string &path);
+
+  Stats stats() const;
+
+ private:
+  struct Entry {
+    FileIdentity identity;
+    Json::Value root;
+  };
+
+  TokenCache() = default;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+
+  std::atomic<uint64_t> hits_ = 0;
+  std::atomic<uint64_t> misses_ = 0;
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_TOKEN_CACHE_H
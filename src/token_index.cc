@@ -0,0 +1,173 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "token_index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sasl/sasl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "token_store.h"
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+constexpr uint32_t kWatchMask =
+    IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM;
+
+TokenIndex *s_index = nullptr;
+
+bool ShouldIndex(const std::string &name) {
+  return !name.empty() && name[0] != '.' && !TokenStore::IsAuxiliaryFile(name);
+}
+
+}  // namespace
+
+/* static */ std::unique_ptr<TokenIndex> TokenIndex::Create(
+    const std::string &dir, std::string *error) {
+  int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    *error = "unable to open " + dir + ": " + strerror(errno);
+    return {};
+  }
+
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    *error = std::string("inotify_init1 failed: ") + strerror(errno);
+    close(dir_fd);
+    return {};
+  }
+
+  std::unique_ptr<TokenIndex> index(new TokenIndex(dir, dir_fd, inotify_fd));
+  if (inotify_add_watch(inotify_fd, dir.c_str(), kWatchMask) < 0) {
+    *error = "unable to watch " + dir + ": " + strerror(errno);
+    return {};
+  }
+
+  std::lock_guard<std::mutex> lock(index->mutex_);
+  if (!index->Scan(error)) return {};
+  return index;
+}
+
+/* static */ int TokenIndex::Init(const std::string &dir) {
+  if (s_index) return SASL_OK;
+
+  std::string error;
+  std::unique_ptr<TokenIndex> index = Create(dir, &error);
+  if (!index) {
+    auto log = Log::Create(Log::OPTIONS_IMMEDIATE);
+    log->Write("TokenIndex::Init: %s", error.c_str());
+    return SASL_FAIL;
+  }
+
+  s_index = index.release();
+  return SASL_OK;
+}
+
+/* static */ TokenIndex *TokenIndex::Get() { return s_index; }
+
+TokenIndex::TokenIndex(const std::string &dir, int dir_fd, int inotify_fd)
+    : dir_(dir), dir_fd_(dir_fd), inotify_fd_(inotify_fd) {}
+
+TokenIndex::~TokenIndex() {
+  close(inotify_fd_);
+  close(dir_fd_);
+}
+
+bool TokenIndex::Lookup(const std::string &user, std::string *name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  DrainEvents();
+  auto it = names_by_user_.find(user);
+  if (it == names_by_user_.end()) return false;
+  *name = it->second;
+  return true;
+}
+
+bool TokenIndex::Scan(std::string *error) {
+  names_by_user_.clear();
+  users_by_name_.clear();
+
+  // fdopendir() takes ownership of its descriptor, so give it a copy.
+  int fd = dup(dir_fd_);
+  DIR *d = (fd < 0) ? nullptr : fdopendir(fd);
+  if (!d) {
+    *error = "unable to read " + dir_ + ": " + strerror(errno);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  rewinddir(d);
+  while (const dirent *entry = readdir(d)) Add(entry->d_name);
+  closedir(d);
+  return true;
+}
+
+void TokenIndex::DrainEvents() {
+  alignas(inotify_event) char buffer[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+  for (;;) {
+    ssize_t len = read(inotify_fd_, buffer, sizeof(buffer));
+    if (len < 0 && errno == EINTR) continue;
+    if (len <= 0) return;
+
+    for (ssize_t i = 0; i < len;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(buffer + i);
+      i += sizeof(inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost; start over.
+        std::string error;
+        Scan(&error);
+        continue;
+      }
+      if (event->len == 0) continue;
+
+      const std::string name = event->name;
+      if (event->mask & (IN_DELETE | IN_MOVED_FROM)) Remove(name);
+      if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) Add(name);
+    }
+  }
+}
+
+void TokenIndex::Add(const std::string &name) {
+  if (!ShouldIndex(name)) return;
+  Remove(name);
+
+  auto log = Log::Create(Log::OPTIONS_NONE, Log::TARGET_NONE);
+  auto store = TokenStore::CreateAt(log.get(), dir_fd_, name,
+                                    /*enable_updates=*/false);
+  if (!store) return;
+
+  const std::string user = store->has_user() ? store->user() : name;
+  names_by_user_[user] = name;
+  users_by_name_[name] = user;
+}
+
+void TokenIndex::Remove(const std::string &name) {
+  auto it = users_by_name_.find(name);
+  if (it == users_by_name_.end()) return;
+
+  // Another file may have since claimed the same user.
+  auto user_it = names_by_user_.find(it->second);
+  if (user_it != names_by_user_.end() && user_it->second == name)
+    names_by_user_.erase(user_it);
+  users_by_name_.erase(it);
+}
+
+}  // namespace sasl_xoauth2
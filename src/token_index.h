@@ -0,0 +1,77 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_TOKEN_INDEX_H
+#define SASL_XOAUTH2_TOKEN_INDEX_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace sasl_xoauth2 {
+
+// Maps users to token files in a single directory. Each file is indexed under
+// its "user" field if it has one, or under its name otherwise.
+//
+// The directory (and an inotify watch on it) is opened once, before Postfix
+// chroots, and the index is kept current by draining inotify events on each
+// lookup. Token files are then opened relative to dir_fd(), so they needn't
+// be reachable from within the chroot.
+class TokenIndex {
+ public:
+  // Builds an index of |dir|. Returns null, and sets |error|, on failure.
+  static std::unique_ptr<TokenIndex> Create(const std::string &dir,
+                                            std::string *error);
+
+  // Sets up the process-wide index returned by Get().
+  static int Init(const std::string &dir);
+  // Returns null if Init() hasn't been called.
+  static TokenIndex *Get();
+
+  ~TokenIndex();
+
+  TokenIndex(const TokenIndex &) = delete;
+  TokenIndex &operator=(const TokenIndex &) = delete;
+
+  // Returns true, and sets |name| to the token file's name within the
+  // directory, if |user| has a token.
+  bool Lookup(const std::string &user, std::string *name);
+
+  const std::string &dir() const { return dir_; }
+  int dir_fd() const { return dir_fd_; }
+
+ private:
+  TokenIndex(const std::string &dir, int dir_fd, int inotify_fd);
+
+  // Callers must hold mutex_.
+  bool Scan(std::string *error);
+  void DrainEvents();
+  void Add(const std::string &name);
+  void Remove(const std::string &name);
+
+  const std::string dir_;
+  const int dir_fd_;
+  const int inotify_fd_;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::string> names_by_user_;
+  std::unordered_map<std::string, std::string> users_by_name_;
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_TOKEN_INDEX_H
@@ -0,0 +1,259 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "token_response.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+namespace sasl_xoauth2 {
+
+namespace {
+
+// Sized for typical tokens, so that most responses don't reallocate.
+constexpr size_t kTokenCapacity = 2048;
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+}  // namespace
+
+TokenResponseParser::TokenResponseParser() {
+  access_token_.reserve(kTokenCapacity);
+  refresh_token_.reserve(kTokenCapacity);
+}
+
+void TokenResponseParser::Feed(const char *data, size_t size) {
+  started_ = true;
+  const char *end = data + size;
+  while (data < end) {
+    if (state_ == State::kDone || state_ == State::kError) return;
+
+    // Most of a response is string contents (the tokens themselves), so
+    // copy those a run at a time rather than a character at a time.
+    const bool in_string = state_ == State::kKey || state_ == State::kString ||
+                           (state_ == State::kNested && in_nested_string_);
+    if (in_string && !escape_) {
+      const char *stop = data;
+      while (stop < end && *stop != '"' && *stop != '\\') stop++;
+      std::string *out = (state_ == State::kKey)      ? &key_
+                         : (state_ == State::kString) ? FieldBuffer()
+                                                      : nullptr;
+      if (out) out->append(data, stop);
+      data = stop;
+      if (data == end) return;
+    }
+
+    Consume(*data++);
+  }
+}
+
+bool TokenResponseParser::Finish() {
+  if (state_ != State::kDone) return false;
+  if (has_expires_in_) {
+    char *end = nullptr;
+    errno = 0;
+    expires_in_ = strtol(expires_in_text_.c_str(), &end, 10);
+    if (errno != 0 || end == expires_in_text_.c_str() ||
+        (*end != '\0' && *end != '.'))
+      return false;
+  }
+  return true;
+}
+
+void TokenResponseParser::Consume(char c) {
+  switch (state_) {
+    case State::kStart:
+      if (IsSpace(c)) return;
+      state_ = (c == '{') ? State::kKeyOrEnd : State::kError;
+      return;
+
+    case State::kKeyOrEnd:
+      if (IsSpace(c)) return;
+      if (c == '}') {
+        state_ = State::kDone;
+      } else if (c == '"') {
+        key_.clear();
+        state_ = State::kKey;
+      } else {
+        state_ = State::kError;
+      }
+      return;
+
+    case State::kKey:
+      if (ConsumeStringChar(c, &key_)) state_ = State::kColon;
+      return;
+
+    case State::kColon:
+      if (IsSpace(c)) return;
+      state_ = (c == ':') ? State::kValue : State::kError;
+      return;
+
+    case State::kValue:
+      if (IsSpace(c)) return;
+      StartValue();
+      if (c == '"') {
+        state_ = State::kString;
+      } else if (c == '{' || c == '[') {
+        nested_depth_ = 1;
+        in_nested_string_ = false;
+        state_ = (field_ == Field::kNone) ? State::kNested : State::kError;
+      } else if (c == ',' || c == '}' || c == ']' || c == ':') {
+        state_ = State::kError;
+      } else {
+        state_ = State::kBareValue;
+        if (std::string *buffer = FieldBuffer()) buffer->push_back(c);
+      }
+      return;
+
+    case State::kString:
+      if (ConsumeStringChar(c, FieldBuffer())) EndValue();
+      return;
+
+    case State::kBareValue:
+      if (IsSpace(c) || c == ',' || c == '}') {
+        // Bare tokens are only acceptable for expires_in.
+        if (field_ == Field::kAccessToken || field_ == Field::kRefreshToken) {
+          state_ = State::kError;
+          return;
+        }
+        EndValue();
+        if (state_ == State::kCommaOrEnd) Consume(c);
+        return;
+      }
+      if (std::string *buffer = FieldBuffer()) buffer->push_back(c);
+      return;
+
+    case State::kNested:
+      if (in_nested_string_) {
+        if (ConsumeStringChar(c, nullptr)) in_nested_string_ = false;
+      } else if (c == '"') {
+        in_nested_string_ = true;
+      } else if (c == '{' || c == '[') {
+        nested_depth_++;
+      } else if ((c == '}' || c == ']') && --nested_depth_ == 0) {
+        EndValue();
+      }
+      return;
+
+    case State::kCommaOrEnd:
+      if (IsSpace(c)) return;
+      if (c == ',') {
+        state_ = State::kKeyOrEnd;
+      } else if (c == '}') {
+        state_ = State::kDone;
+      } else {
+        state_ = State::kError;
+      }
+      return;
+
+    case State::kDone:
+    case State::kError:
+      return;
+  }
+}
+
+bool TokenResponseParser::ConsumeStringChar(char c, std::string *out) {
+  if (escape_) {
+    escape_ = false;
+    char unescaped;
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        unescaped = c;
+        break;
+      case 'b':
+        unescaped = '\b';
+        break;
+      case 'f':
+        unescaped = '\f';
+        break;
+      case 'n':
+        unescaped = '\n';
+        break;
+      case 'r':
+        unescaped = '\r';
+        break;
+      case 't':
+        unescaped = '\t';
+        break;
+      default:
+        // Including \u, which isn't worth handling here.
+        state_ = State::kError;
+        return false;
+    }
+    if (out) out->push_back(unescaped);
+    return false;
+  }
+  if (c == '\\') {
+    escape_ = true;
+    return false;
+  }
+  if (c == '"') return true;
+  if (out) out->push_back(c);
+  return false;
+}
+
+void TokenResponseParser::StartValue() {
+  if (key_ == "access_token") {
+    field_ = Field::kAccessToken;
+    access_token_.clear();
+  } else if (key_ == "expires_in") {
+    field_ = Field::kExpiresIn;
+    expires_in_text_.clear();
+  } else if (key_ == "refresh_token") {
+    field_ = Field::kRefreshToken;
+    refresh_token_.clear();
+  } else {
+    field_ = Field::kNone;
+  }
+}
+
+void TokenResponseParser::EndValue() {
+  switch (field_) {
+    case Field::kAccessToken:
+      has_access_token_ = true;
+      break;
+    case Field::kExpiresIn:
+      has_expires_in_ = true;
+      break;
+    case Field::kRefreshToken:
+      has_refresh_token_ = true;
+      break;
+    case Field::kNone:
+      break;
+  }
+  field_ = Field::kNone;
+  state_ = (has_access_token_ && has_expires_in_ && has_refresh_token_)
+               ? State::kDone
+               : State::kCommaOrEnd;
+}
+
+std::string *TokenResponseParser::FieldBuffer() {
+  switch (field_) {
+    case Field::kAccessToken:
+      return &access_token_;
+    case Field::kExpiresIn:
+      return &expires_in_text_;
+    case Field::kRefreshToken:
+      return &refresh_token_;
+    case Field::kNone:
+      return nullptr;
+  }
+  return nullptr;
+}
+
+}  // namespace sasl_xoauth2
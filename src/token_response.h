@@ -0,0 +1,101 @@
+/*
+ * Copyright 2020 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SASL_XOAUTH2_TOKEN_RESPONSE_H
+#define SASL_XOAUTH2_TOKEN_RESPONSE_H
+
+#include <stddef.h>
+
+#include <string>
+
+namespace sasl_xoauth2 {
+
+// Extracts access_token, expires_in, and refresh_token from a token endpoint's
+// JSON response as it arrives, without building a DOM. Other values are
+// skipped, and parsing stops once all three fields have been seen.
+//
+// Only handles what token endpoints actually send; anything else (a \u escape,
+// say, or a non-object response) fails, and callers should fall back to a
+// full JSON parser.
+class TokenResponseParser {
+ public:
+  TokenResponseParser();
+
+  void Feed(const char *data, size_t size);
+  // Returns true if the response was parsed. Fields missing from the response
+  // have has_*() false.
+  bool Finish();
+
+  bool started() const { return started_; }
+
+  bool has_access_token() const { return has_access_token_; }
+  const std::string &access_token() const { return access_token_; }
+  bool has_expires_in() const { return has_expires_in_; }
+  long expires_in() const { return expires_in_; }
+  bool has_refresh_token() const { return has_refresh_token_; }
+  const std::string &refresh_token() const { return refresh_token_; }
+
+ private:
+  enum class State {
+    kStart,
+    kKeyOrEnd,
+    kKey,
+    kColon,
+    kValue,
+    kString,
+    kBareValue,
+    kNested,
+    kCommaOrEnd,
+    kDone,
+    kError,
+  };
+
+  enum class Field {
+    kNone,
+    kAccessToken,
+    kExpiresIn,
+    kRefreshToken,
+  };
+
+  void Consume(char c);
+  // Handles |c| within a string, appending it (unescaped) to |out| if set.
+  // Returns true at the closing quote.
+  bool ConsumeStringChar(char c, std::string *out);
+  void StartValue();
+  void EndValue();
+  std::string *FieldBuffer();
+
+  State state_ = State::kStart;
+  bool started_ = false;
+  bool escape_ = false;
+  bool in_nested_string_ = false;
+  int nested_depth_ = 0;
+
+  std::string key_;
+  Field field_ = Field::kNone;
+
+  bool has_access_token_ = false;
+  bool has_expires_in_ = false;
+  bool has_refresh_token_ = false;
+  std::string access_token_;
+  std::string expires_in_text_;
+  std::string refresh_token_;
+  long expires_in_ = 0;
+};
+
+}  // namespace sasl_xoauth2
+
+#endif  // SASL_XOAUTH2_TOKEN_RESPONSE_H
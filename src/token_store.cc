@@ -14,22 +14,39 @@
 
 #include "token_store.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <json/json.h>
 #include <sasl/sasl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <fstream>
+#include <algorithm>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
 #include <sstream>
 
+#include "binary_token.h"
+#include "circuit_breaker.h"
 #include "config.h"
+#include "file_lock.h"
 #include "http.h"
 #include "log.h"
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "shared_token_cache.h"
+#include "token_cache.h"
+#include "token_index.h"
+#include "token_response.h"
 
 namespace sasl_xoauth2 {
 
@@ -37,6 +54,109 @@ namespace {
 
 constexpr int kMaxRefreshAttempts = 2;
 
+// After consecutive failed refreshes, wait (roughly) this long, doubling with
+// each failure up to the maximum, before contacting the token endpoint again.
+constexpr int kInitialRefreshBackoff = 10;  // seconds
+constexpr int kMaxRefreshBackoff = 3600;    // seconds
+
+// How long a refresh may wait for the refresh rate limit.
+constexpr std::chrono::milliseconds kMaxRateLimitWait{1000};
+
+constexpr char kLockFileSuffix[] = ".lock";
+
+// Refreshes currently in progress in this process, keyed by token path.
+std::mutex s_in_flight_mutex;
+std::map<std::string, std::shared_future<int>> s_in_flight;
+
+// A refresh registered in s_in_flight, for other refreshes of the same token
+// to wait on. If it's never finished (because the refresh threw, say), it's
+// unregistered on destruction, and waiters see SASL_FAIL.
+class InFlightRefresh {
+ public:
+  // Returns null, and sets |existing|, if |key| is already being refreshed.
+  static std::unique_ptr<InFlightRefresh> Start(
+      const std::string &key, std::shared_future<int> *existing) {
+    std::unique_ptr<InFlightRefresh> refresh(new InFlightRefresh(key));
+    std::lock_guard<std::mutex> lock(s_in_flight_mutex);
+    auto it = s_in_flight.find(key);
+    if (it != s_in_flight.end()) {
+      *existing = it->second;
+      refresh->finished_ = true;
+      return nullptr;
+    }
+    s_in_flight.emplace(key, refresh->promise_.get_future().share());
+    return refresh;
+  }
+
+  ~InFlightRefresh() {
+    if (!finished_) Finish(SASL_FAIL);
+  }
+
+  void Finish(int err) {
+    {
+      std::lock_guard<std::mutex> lock(s_in_flight_mutex);
+      s_in_flight.erase(key_);
+    }
+    finished_ = true;
+    promise_.set_value(err);
+  }
+
+ private:
+  explicit InFlightRefresh(const std::string &key) : key_(key) {}
+
+  const std::string key_;
+  std::promise<int> promise_;
+  bool finished_ = false;
+};
+
+int RecordRefreshResult(int err) {
+  Metrics::Increment(err == SASL_OK ? Metrics::REFRESH_SUCCESSES
+                                    : Metrics::REFRESH_FAILURES);
+  return err;
+}
+
+std::string GetKey(int dir_fd, const std::string &path) {
+  if (dir_fd == AT_FDCWD) return path;
+  return "fd:" + std::to_string(dir_fd) + "/" + path;
+}
+
+// Like GetKey(), but the same in every process (or empty if there's no such
+// key), for SharedTokenCache.
+std::string GetSharedKey(int dir_fd, const std::string &path) {
+  if (dir_fd == AT_FDCWD) return path;
+  const TokenIndex *index = TokenIndex::Get();
+  if (index && index->dir_fd() == dir_fd) return index->dir() + "/" + path;
+  return "";
+}
+
+bool WriteAll(int fd, const std::string &data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+// Returns a random delay between half and all of the capped, exponential
+// backoff for |failures| consecutive failures, so that processes (and hosts)
+// that failed together don't all retry together.
+int GetRefreshBackoff(int failures) {
+  int backoff = kMaxRefreshBackoff;
+  if (failures <= 16)
+    backoff = std::min(kMaxRefreshBackoff,
+                       kInitialRefreshBackoff << std::max(failures - 1, 0));
+
+  static std::mutex s_random_mutex;
+  static std::minstd_rand s_random(getpid() ^ time(nullptr));
+  std::lock_guard<std::mutex> lock(s_random_mutex);
+  return std::uniform_int_distribution<int>(backoff / 2, backoff)(s_random);
+}
+
 std::string GetTempSuffix() {
   timeval t = {};
   gettimeofday(&t, nullptr);
@@ -63,156 +183,671 @@ void WriteOverride(const std::string &key,
   }
 }
 
+void ReadOverride(const Json::Value &root, const std::string &key,
+                  std::optional<int> *output) {
+  if (root.isMember(key)) {
+    *output = stoi(root[key].asString());
+  }
+}
+
+void WriteOverride(const std::string &key, const std::optional<int> &value,
+                   Json::Value *output) {
+  if (value) {
+    (*output)[key] = std::to_string(*value);
+  }
+}
+
+void ReadOverride(const BinaryToken::Reader &reader, BinaryToken::Field field,
+                  std::optional<std::string> *output) {
+  std::string_view value;
+  if (reader.Get(field, &value)) {
+    *output = std::string(value);
+  }
+}
+
+void WriteOverride(BinaryToken::Field field,
+                   const std::optional<std::string> &value,
+                   BinaryToken::Writer *output) {
+  if (value) {
+    output->Set(field, *value);
+  }
+}
+
+void ReadOverride(const BinaryToken::Reader &reader, BinaryToken::Field field,
+                  std::optional<int> *output) {
+  std::string_view value;
+  if (reader.Get(field, &value)) {
+    *output = stoi(std::string(value));
+  }
+}
+
+void WriteOverride(BinaryToken::Field field, const std::optional<int> &value,
+                   BinaryToken::Writer *output) {
+  if (value) {
+    output->Set(field, std::to_string(*value));
+  }
+}
+
+class FileDescriptor {
+ public:
+  explicit FileDescriptor(int fd) : fd_(fd) {}
+  ~FileDescriptor() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  int get() const { return fd_; }
+
+ private:
+  const int fd_;
+};
+
+// Read-only mapping of an entire file.
+class MappedFile {
+ public:
+  MappedFile(int fd, size_t size) : size_(size) {
+    if (size_ == 0) return;
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) data_ = static_cast<const char *>(data);
+  }
+
+  ~MappedFile() {
+    if (data_) munmap(const_cast<char *>(data_), size_);
+  }
+
+  const char *data() const { return data_; }
+  size_t size() const { return data_ ? size_ : 0; }
+
+ private:
+  const char *data_ = nullptr;
+  const size_t size_;
+};
+
 }  // namespace
 
+/* static */ bool TokenStore::IsAuxiliaryFile(const std::string &path) {
+  const size_t lock_len = strlen(kLockFileSuffix);
+  if (path.size() >= lock_len &&
+      path.compare(path.size() - lock_len, lock_len, kLockFileSuffix) == 0)
+    return true;
+
+  // Temporary files end in ".<pid>.<time>" (see GetTempSuffix()).
+  int dots = 0;
+  for (auto it = path.rbegin(); it != path.rend() && dots < 2; ++it) {
+    if (*it == '.') {
+      if (it == path.rbegin() || !isdigit(*(it - 1))) return false;
+      dots++;
+    } else if (!isdigit(*it)) {
+      return false;
+    }
+  }
+  return dots == 2;
+}
+
 /* static */ std::unique_ptr<TokenStore> TokenStore::Create(
     Log *log, const std::string &path, bool enable_updates) {
-  std::unique_ptr<TokenStore> store(new TokenStore(log, path, enable_updates));
+  return CreateAt(log, AT_FDCWD, path, enable_updates);
+}
+
+/* static */ std::unique_ptr<TokenStore> TokenStore::CreateAt(
+    Log *log, int dir_fd, const std::string &name, bool enable_updates) {
+  std::unique_ptr<TokenStore> store(
+      new TokenStore(log, dir_fd, name, enable_updates));
   if (store->Read() != SASL_OK) return {};
   return store;
 }
 
+int TokenStore::Reload() {
+  refresh_attempts_ = 0;
+  struct stat st = {};
+  if (identity_ && fstatat(dir_fd_, path_.c_str(), &st, 0) == 0 &&
+      *identity_ == TokenCache::FileIdentity(st)) {
+    log_->Write("TokenStore::Reload: file %s unchanged", path_.c_str());
+    // The config may have changed, though.
+    ResolveSettings();
+    return SASL_OK;
+  }
+
+  override_client_id_.reset();
+  override_client_secret_.reset();
+  override_token_endpoint_.reset();
+  override_hedge_token_endpoints_.reset();
+  override_proxy_.reset();
+  override_ca_bundle_file_.reset();
+  override_ca_certs_dir_.reset();
+  override_refresh_window_.reset();
+  override_connect_timeout_.reset();
+  override_request_timeout_.reset();
+  override_low_speed_limit_.reset();
+  override_low_speed_time_.reset();
+  override_ip_family_.reset();
+  override_happy_eyeballs_timeout_ms_.reset();
+  access_.clear();
+  access_generation_++;
+  user_.reset();
+  expiry_ = 0;
+  return Read();
+}
+
 int TokenStore::GetAccessToken(std::string *token) {
-  const int refresh_window =
-      override_refresh_window_.value_or(Config::Get()->refresh_window());
+  int err = PrepareAccessToken();
+  if (err != SASL_OK) return err;
+  *token = access_;
+  return SASL_OK;
+}
 
-  if ((time(nullptr) + refresh_window) >= expiry_) {
-    log_->Write("TokenStore::GetAccessToken: token expired. refreshing.");
-    int err = Refresh();
-    if (err != SASL_OK) return err;
+int TokenStore::GetInitialResponse(const std::string &user,
+                                   const std::string **response) {
+  int err = PrepareAccessToken();
+  if (err != SASL_OK) return err;
+
+  if (initial_response_generation_ != access_generation_ ||
+      initial_response_user_ != user) {
+    initial_response_.assign("user=").append(user).append("\1auth=Bearer ");
+    initial_response_.append(access_).append("\1\1");
+    initial_response_user_ = user;
+    initial_response_generation_ = access_generation_;
   }
+  *response = &initial_response_;
+  return SASL_OK;
+}
 
-  *token = access_;
+int TokenStore::PrepareAccessToken() {
+  if (NeedsRefresh() && ReadSharedToken()) {
+    log_->Write(
+        "TokenStore::GetAccessToken: using token refreshed by another "
+        "process");
+  }
+
+  // While the token endpoint is down, a token that hasn't quite expired is
+  // better than waiting on a refresh that will fail.
+  const bool still_valid = time(nullptr) < expiry_;
+  if (NeedsRefresh() && still_valid &&
+      CircuitBreaker::IsOpen(*settings_.token_endpoint)) {
+    log_->Write(
+        "TokenStore::GetAccessToken: token endpoint unavailable. using token "
+        "until it expires.");
+    return SASL_OK;
+  }
+
+  if (NeedsRefresh()) {
+    if (CanRefreshInBackground()) {
+      log_->Write(
+          "TokenStore::GetAccessToken: token expiring. refreshing in "
+          "background.");
+      StartBackgroundRefresh();
+    } else {
+      log_->Write("TokenStore::GetAccessToken: token expired. refreshing.");
+      int err = Refresh();
+      if (err == SASL_UNAVAIL && still_valid) return SASL_OK;
+      if (err != SASL_OK) return err;
+    }
+  }
   return SASL_OK;
 }
 
+bool TokenStore::ReadSharedToken() {
+  if (shared_key_.empty()) return false;
+  time_t expiry = 0;
+  if (!SharedTokenCache::Lookup(shared_key_, refresh_, &shared_access_,
+                                &expiry) ||
+      expiry <= expiry_)
+    return false;
+
+  access_.swap(shared_access_);
+  access_generation_++;
+  expiry_ = expiry;
+  // No longer what was read from the file.
+  identity_.reset();
+  return true;
+}
+
 int TokenStore::Refresh() {
   if (refresh_attempts_ > kMaxRefreshAttempts) {
     log_->Write("TokenStore::Refresh: exceeded maximum attempts");
     return SASL_BADPROT;
   }
+  // Not attempted, so (like an unavailable endpoint) a token that hasn't yet
+  // expired is still used.
+  if (BackingOff()) return SASL_UNAVAIL;
   refresh_attempts_++;
   log_->Write("TokenStore::Refresh: attempt %d", refresh_attempts_);
 
-  const std::string client_id =
-      override_client_id_.value_or(Config::Get()->client_id());
-  const std::string client_secret =
-      override_client_secret_.value_or(Config::Get()->client_secret());
-  const std::string token_endpoint =
-      override_token_endpoint_.value_or(Config::Get()->token_endpoint());
+  // Without updates, nothing we fetch is visible to anyone else, so there's
+  // nothing to coordinate.
+  if (!enable_updates_) return RefreshFromServer();
+
+  std::shared_future<int> in_flight;
+  auto refresh = InFlightRefresh::Start(key_, &in_flight);
+  if (!refresh) {
+    log_->Write("TokenStore::Refresh: waiting for in-flight refresh");
+    int err = in_flight.get();
+    if (err != SASL_OK) return err;
+    return Read();
+  }
+
+  int err = RefreshWithFileLock();
+  refresh->Finish(err);
+  return err;
+}
+
+int TokenStore::RefreshWithin(int time_limit) {
+  refresh_time_limit_ = time_limit;
+  const int err = Refresh();
+  refresh_time_limit_ = 0;
+  return err;
+}
+
+bool TokenStore::BackingOff() const {
+  const time_t now = time(nullptr);
+  if (now >= retry_after_) return false;
+  log_->Write(
+      "TokenStore::Refresh: %d consecutive failure(s), last: %s. not retrying "
+      "for %d seconds",
+      refresh_failures_, last_refresh_failure_.c_str(),
+      static_cast<int>(retry_after_ - now));
+  return true;
+}
+
+int TokenStore::RefreshFailed(const char *failure, int err) {
+  refresh_failures_++;
+  const int backoff = GetRefreshBackoff(refresh_failures_);
+  retry_after_ = time(nullptr) + backoff;
+  last_refresh_failure_ = failure;
+  log_->Write("TokenStore::Refresh: %s failure, backing off for %d seconds",
+              failure, backoff);
+  // Record the backoff for other processes (and later messages). The failure
+  // is what matters to the caller, not whether this succeeded.
+  Write();
+  return err;
+}
+
+bool TokenStore::ExpiresWithin(int seconds) const {
+  return (time(nullptr) + seconds) >= expiry_;
+}
+
+bool TokenStore::WithinRateLimit(std::chrono::milliseconds max_wait) const {
+  const Config *config = Config::Get();
+  if (RateLimiter::Acquire(*settings_.token_endpoint + '\n' +
+                               *settings_.client_id,
+                           config->refresh_rate_limit(),
+                           config->refresh_rate_burst(), max_wait))
+    return true;
+  log_->Write("TokenStore::Refresh: refresh rate limit for %s exceeded",
+              settings_.token_endpoint->c_str());
+  return false;
+}
+
+bool TokenStore::NeedsRefresh() const {
+  return ExpiresWithin(settings_.refresh_window);
+}
+
+bool TokenStore::CanRefreshInBackground() const {
+  // A background refresh is only visible to later authentications through
+  // the token file, and is only worth it while the current token still works.
+  return Config::Get()->async_refresh() && enable_updates_ &&
+         time(nullptr) < expiry_;
+}
+
+void TokenStore::StartBackgroundRefresh() {
+  if (BackingOff()) return;
 
-  const std::string proxy = override_proxy_.value_or(Config::Get()->proxy());
+  std::shared_future<int> in_flight;
+  std::shared_ptr<InFlightRefresh> refresh =
+      InFlightRefresh::Start(key_, &in_flight);
+  if (!refresh) {
+    log_->Write("TokenStore::Refresh: refresh already in flight");
+    return;
+  }
+
+  // Don't wait on another process's refresh; the current token is good
+  // enough until it's done.
+  const std::string lock_path = path_ + kLockFileSuffix;
+  std::string lock_error;
+  std::shared_ptr<FileLock> lock =
+      FileLock::TryAcquire(dir_fd_, lock_path, &lock_error);
+  if (!lock) {
+    log_->Write("TokenStore::Refresh: not refreshing, unable to lock %s: %s",
+                lock_path.c_str(), lock_error.c_str());
+    refresh->Finish(SASL_OK);
+    return;
+  }
 
-  const std::string ca_bundle_file =
-      override_ca_bundle_file_.value_or(Config::Get()->ca_bundle_file());
+  // The refresh outlives this TokenStore (and its log), so it works on a copy
+  // re-read from the token file.
+  std::shared_ptr<Log> log = Log::Create();
+  std::shared_ptr<TokenStore> store(
+      new TokenStore(log.get(), dir_fd_, path_, enable_updates_));
+  if (store->Read() != SASL_OK || !store->NeedsRefresh()) {
+    log_->Write("TokenStore::Refresh: token refreshed by another process");
+    refresh->Finish(SASL_OK);
+    return;
+  }
+  if (store->BackingOff() ||
+      !store->WithinRateLimit(std::chrono::milliseconds::zero())) {
+    refresh->Finish(SASL_OK);
+    return;
+  }
+
+  const Settings &settings = store->settings_;
+  HttpPostAsync(
+      {.url = *settings.token_endpoint,
+       .data = store->MakeRefreshRequest(),
+       .proxy = *settings.proxy,
+       .ca_bundle_file = *settings.ca_bundle_file,
+       .ca_certs_dir = *settings.ca_certs_dir,
+       .response_code = nullptr,
+       .response = nullptr,
+       .error = nullptr,
+       .transport = settings.transport},
+      [log, store, lock, refresh](const HttpResult &result) {
+        TokenResponseParser parser;
+        const int err =
+            RecordRefreshResult(store->HandleRefreshResponse(result, &parser));
+        if (err != SASL_OK) log->SetFlushOnDestroy();
+        refresh->Finish(err);
+      });
+}
+
+int TokenStore::RefreshWithFileLock() {
+  const std::string lock_path = path_ + kLockFileSuffix;
+  std::string lock_error;
+  auto lock = FileLock::Acquire(dir_fd_, lock_path, &lock_error);
+  if (!lock) {
+    log_->Write("TokenStore::Refresh: unable to lock %s: %s", lock_path.c_str(),
+                lock_error.c_str());
+    return RefreshFromServer();
+  }
+
+  // Another process may have refreshed the token while we were waiting for
+  // the lock. If so, use its result rather than refreshing again.
+  const std::string previous_access = access_;
+  if (Read() == SASL_OK && access_ != previous_access && !NeedsRefresh()) {
+    log_->Write("TokenStore::Refresh: token refreshed by another process");
+    return SASL_OK;
+  }
+  // Or failed to.
+  if (BackingOff()) return SASL_UNAVAIL;
+
+  return RefreshFromServer();
+}
+
+int TokenStore::RefreshFromServer() {
+  // Reported like an unavailable endpoint, so that a token that hasn't yet
+  // expired is still used.
+  if (!WithinRateLimit(kMaxRateLimitWait)) return SASL_UNAVAIL;
+
+  const std::string request = MakeRefreshRequest();
+  TokenResponseParser parser;
+  HttpResult result;
+  HttpTransportOptions transport = settings_.transport;
+  if (refresh_time_limit_ > 0) {
+    auto limit = [this](int *timeout) {
+      if (*timeout == 0 || *timeout > refresh_time_limit_)
+        *timeout = refresh_time_limit_;
+    };
+    limit(&transport.connect_timeout);
+    limit(&transport.request_timeout);
+  }
+  result.err = HttpPost({.url = *settings_.token_endpoint,
+                         .data = request,
+                         .proxy = *settings_.proxy,
+                         .ca_bundle_file = *settings_.ca_bundle_file,
+                         .ca_certs_dir = *settings_.ca_certs_dir,
+                         .response_code = &result.response_code,
+                         .response = &result.response,
+                         .error = &result.error,
+                         .transport = transport,
+                         .hedge_urls = settings_.hedge_token_endpoints,
+                         .on_data = [&parser](const char *data, size_t size) {
+                           parser.Feed(data, size);
+                         },
+                         .timings = &result.timings});
+  return RecordRefreshResult(HandleRefreshResponse(result, &parser));
+}
+
+void TokenStore::LogTimings(const HttpTimings &timings) const {
+  // Not set for intercepted requests.
+  if (timings.total.count() == 0) return;
+  auto ms = [](std::chrono::microseconds time) {
+    return static_cast<double>(time.count()) / 1000;
+  };
+  log_->Write(
+      "TokenStore::Refresh: timings (ms): name_lookup=%.3f, connect=%.3f, "
+      "app_connect=%.3f, pre_transfer=%.3f, start_transfer=%.3f, "
+      "total=%.3f, reused=%d, proxied=%d",
+      ms(timings.name_lookup), ms(timings.connect), ms(timings.app_connect),
+      ms(timings.pre_transfer), ms(timings.start_transfer), ms(timings.total),
+      timings.connection_reused, timings.proxied);
+}
 
-  const std::string ca_certs_dir =
-      override_ca_certs_dir_.value_or(Config::Get()->ca_certs_dir());
+std::string TokenStore::MakeRefreshRequest() const {
+  Metrics::Increment(Metrics::REFRESH_ATTEMPTS);
+
+  constexpr char kClientId[] = "client_id=";
+  constexpr char kClientSecret[] = "&client_secret=";
+  constexpr char kRefreshToken[] = "&grant_type=refresh_token&refresh_token=";
+  std::string request;
+  request.reserve(sizeof(kClientId) + settings_.client_id->size() +
+                  sizeof(kClientSecret) + settings_.client_secret->size() +
+                  sizeof(kRefreshToken) + refresh_.size());
+  request.append(kClientId).append(*settings_.client_id);
+  request.append(kClientSecret).append(*settings_.client_secret);
+  request.append(kRefreshToken).append(refresh_);
 
-  const std::string request =
-      std::string("client_id=") + client_id +
-      "&client_secret=" + client_secret +
-      "&grant_type=refresh_token&refresh_token=" + refresh_;
-  std::string response;
-  long response_code = 0;
   log_->Write("TokenStore::Refresh: token_endpoint: %s",
-              token_endpoint.c_str());
+              settings_.token_endpoint->c_str());
   log_->Write("TokenStore::Refresh: request: %s", request.c_str());
+  return request;
+}
 
-  std::string http_error;
-  int err = HttpPost({.url = token_endpoint,
-                      .data = request,
-                      .proxy = proxy,
-                      .ca_bundle_file = ca_bundle_file,
-                      .ca_certs_dir = ca_certs_dir,
-                      .response_code = &response_code,
-                      .response = &response,
-                      .error = &http_error});
-  if (err != SASL_OK) {
-    log_->Write("TokenStore::Refresh: http error: %s", http_error.c_str());
-    return err;
+int TokenStore::HandleRefreshResponse(const HttpResult &result,
+                                      TokenResponseParser *parser) {
+  if (result.err == SASL_UNAVAIL) {
+    // Not attempted, so no reason to back off this token in particular.
+    log_->Write("TokenStore::Refresh: %s", result.error.c_str());
+    return result.err;
+  }
+  LogTimings(result.timings);
+  if (result.err != SASL_OK) {
+    log_->Write("TokenStore::Refresh: http error: %s", result.error.c_str());
+    return RefreshFailed("transport", result.err);
   }
 
-  log_->Write("TokenStore::Refresh: code=%d, response=%s", response_code,
-              response.c_str());
+  const std::string &response = result.response;
+  log_->Write("TokenStore::Refresh: code=%d, response=%s",
+              result.response_code, response.c_str());
 
-  if (response_code != 200) {
+  if (result.response_code != 200) {
     log_->Write("TokenStore::Refresh: request failed");
-    return SASL_BADPROT;
+    // 400 and 401 mean the refresh token (or client) was rejected, which
+    // retrying won't fix; anything else is the server's problem.
+    const bool rejected =
+        result.response_code == 400 || result.response_code == 401;
+    return RefreshFailed(rejected ? "rejected" : "server", SASL_BADPROT);
   }
 
+  if (!parser->started()) parser->Feed(response.data(), response.size());
+  if (parser->Finish()) {
+    if (!parser->has_access_token() || !parser->has_expires_in()) {
+      log_->Write("TokenStore::Refresh: response doesn't contain access_token");
+      return RefreshFailed("response", SASL_BADPROT);
+    }
+    return UpdateToken(
+        parser->access_token(), parser->expires_in(),
+        parser->has_refresh_token() ? &parser->refresh_token() : nullptr);
+  }
+
+  log_->Write("TokenStore::Refresh: falling back to full JSON parser");
   try {
     std::stringstream ss(response);
     Json::Value root;
     ss >> root;
     if (!root.isMember("access_token") || !root.isMember("expires_in")) {
       log_->Write("TokenStore::Refresh: response doesn't contain access_token");
-      return SASL_BADPROT;
-    }
-    access_ = root["access_token"].asString();
-    int expiry_sec = stoi(root["expires_in"].asString());
-    if (expiry_sec <= 0) {
-      log_->Write("TokenStore::Refresh: invalid expiry");
-      return SASL_BADPROT;
-    }
-    if (root.isMember("refresh_token")) {
-      const std::string refresh_token = root["refresh_token"].asString();
-      if (refresh_token != refresh_) {
-        log_->Write(
-            "TokenStore::Refresh: response includes updated refresh token");
-        refresh_ = refresh_token;
-      }
+      return RefreshFailed("response", SASL_BADPROT);
     }
-    expiry_ = time(nullptr) + expiry_sec;
+    const std::string refresh_token = root.isMember("refresh_token")
+                                          ? root["refresh_token"].asString()
+                                          : "";
+    return UpdateToken(root["access_token"].asString(),
+                       stoi(root["expires_in"].asString()),
+                       root.isMember("refresh_token") ? &refresh_token : nullptr);
   } catch (const std::exception &e) {
     log_->Write("TokenStore::Refresh: exception=%s", e.what());
-    return SASL_FAIL;
+    return RefreshFailed("response", SASL_FAIL);
+  }
+}
+
+int TokenStore::UpdateToken(const std::string &access_token, long expires_in,
+                            const std::string *refresh_token) {
+  identity_.reset();
+  access_ = access_token;
+  access_generation_++;
+  if (expires_in <= 0) {
+    log_->Write("TokenStore::Refresh: invalid expiry");
+    return SASL_BADPROT;
+  }
+  if (refresh_token && *refresh_token != refresh_) {
+    log_->Write("TokenStore::Refresh: response includes updated refresh token");
+    refresh_ = *refresh_token;
   }
+  expiry_ = time(nullptr) + expires_in;
+  refresh_failures_ = 0;
+  retry_after_ = 0;
+  last_refresh_failure_.clear();
 
-  return Write();
+  int err = Write();
+  if (err == SASL_OK) {
+    Metrics::SetTokenExpiry(path_, expiry_);
+    if (!shared_key_.empty())
+      SharedTokenCache::Publish(shared_key_, refresh_, access_, expiry_);
+  }
+  return err;
 }
 
-TokenStore::TokenStore(Log *log, const std::string &path, bool enable_updates)
-    : log_(log), path_(path), enable_updates_(enable_updates) {}
+TokenStore::TokenStore(Log *log, int dir_fd, const std::string &path,
+                       bool enable_updates)
+    : log_(log),
+      dir_fd_(dir_fd),
+      path_(path),
+      key_(GetKey(dir_fd, path)),
+      shared_key_(GetSharedKey(dir_fd, path)),
+      enable_updates_(enable_updates) {
+  ResolveSettings();
+}
+
+void TokenStore::ResolveSettings() {
+  const Config *config = Config::Get();
+  auto resolve = [](const std::optional<std::string> &override_value,
+                    const std::string &config_value) {
+    return override_value ? &*override_value : &config_value;
+  };
+  settings_.client_id = resolve(override_client_id_, config->client_id());
+  settings_.client_secret =
+      resolve(override_client_secret_, config->client_secret());
+  settings_.token_endpoint =
+      resolve(override_token_endpoint_, config->token_endpoint());
+  if (override_hedge_token_endpoints_) {
+    hedge_token_endpoints_ = ParseUrlList(*override_hedge_token_endpoints_);
+    settings_.hedge_token_endpoints = &hedge_token_endpoints_;
+  } else {
+    settings_.hedge_token_endpoints = &config->hedge_token_endpoints();
+  }
+  settings_.proxy = resolve(override_proxy_, config->proxy());
+  settings_.ca_bundle_file =
+      resolve(override_ca_bundle_file_, config->ca_bundle_file());
+  settings_.ca_certs_dir =
+      resolve(override_ca_certs_dir_, config->ca_certs_dir());
+  settings_.refresh_window =
+      override_refresh_window_.value_or(config->refresh_window());
+
+  const HttpTransportOptions &transport = config->transport();
+  settings_.transport.connect_timeout =
+      override_connect_timeout_.value_or(transport.connect_timeout);
+  settings_.transport.request_timeout =
+      override_request_timeout_.value_or(transport.request_timeout);
+  settings_.transport.low_speed_limit =
+      override_low_speed_limit_.value_or(transport.low_speed_limit);
+  settings_.transport.low_speed_time =
+      override_low_speed_time_.value_or(transport.low_speed_time);
+  settings_.transport.happy_eyeballs_timeout_ms =
+      override_happy_eyeballs_timeout_ms_.value_or(
+          transport.happy_eyeballs_timeout_ms);
+  settings_.transport.ip_family = transport.ip_family;
+  if (override_ip_family_ &&
+      !ParseIpFamily(*override_ip_family_, &settings_.transport.ip_family)) {
+    log_->Write("TokenStore::ResolveSettings: ignoring invalid ip_family=%s",
+                override_ip_family_->c_str());
+  }
+}
 
 int TokenStore::Read() {
+  Metrics::Increment(Metrics::TOKEN_READS);
+  identity_.reset();
+  // However reading ends, settings_ must be re-resolved: Reload() has reset
+  // the overrides it may point into, and a failed read may have set only some.
+  struct ResolveOnExit {
+    TokenStore *store;
+    ~ResolveOnExit() { store->ResolveSettings(); }
+  } resolve_on_exit{this};
   try {
     log_->Write("TokenStore::Read: file=%s", path_.c_str());
 
-    std::ifstream file(path_);
-    if (!file.good()) {
+    FileDescriptor fd(openat(dir_fd_, path_.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() < 0) {
       log_->Write("TokenStore::Read: failed to open file %s: %s", path_.c_str(),
                   strerror(errno));
       return SASL_FAIL;
     }
 
-    Json::Value root;
-    file >> root;
-    if (!root.isMember("refresh_token")) {
-      log_->Write("TokenStore::Read: missing refresh_token");
+    struct stat st = {};
+    if (fstat(fd.get(), &st) != 0) {
+      log_->Write("TokenStore::Read: failed to stat file %s: %s", path_.c_str(),
+                  strerror(errno));
       return SASL_FAIL;
     }
+    auto remember_identity = [this, &st](int err) {
+      if (err == SASL_OK) identity_.emplace(st);
+      return err;
+    };
 
-    ReadOverride(root, "client_id", &override_client_id_);
-    ReadOverride(root, "client_secret", &override_client_secret_);
-    ReadOverride(root, "token_endpoint", &override_token_endpoint_);
-    ReadOverride(root, "proxy", &override_proxy_);
-    ReadOverride(root, "ca_bundle_file", &override_ca_bundle_file_);
-    ReadOverride(root, "ca_certs_dir", &override_ca_certs_dir_);
-
-    if (root.isMember("refresh_window"))
-      override_refresh_window_ = stoi(root["refresh_window"].asString());
+    Json::Value root;
+    if (TokenCache::Get()->Lookup(key_, st, &root)) {
+      log_->Write("TokenStore::Read: using cached contents");
+      format_ = FORMAT_JSON;
+      return remember_identity(ReadJson(root));
+    }
 
-    refresh_ = root["refresh_token"].asString();
-    if (root.isMember("access_token"))
-      access_ = root["access_token"].asString();
-    if (root.isMember("expiry")) expiry_ = stoi(root["expiry"].asString());
+    MappedFile file(fd.get(), st.st_size);
+    if (!file.data() && st.st_size > 0) {
+      log_->Write("TokenStore::Read: failed to map file %s: %s", path_.c_str(),
+                  strerror(errno));
+      return SASL_FAIL;
+    }
 
-    ReadOverride(root, "user", &user_);
+    if (BinaryToken::IsBinary(file.data(), file.size())) {
+      BinaryToken::Reader reader;
+      std::string error;
+      if (!reader.Init(file.data(), file.size(), &error)) {
+        log_->Write("TokenStore::Read: invalid binary token: %s",
+                    error.c_str());
+        return SASL_FAIL;
+      }
+      format_ = FORMAT_BINARY;
+      return remember_identity(ReadBinary(reader));
+    }
 
-    log_->Write("TokenStore::Read: refresh=%s, access=%s, user=%s",
-                refresh_.c_str(), access_.c_str(), user_.value_or("").c_str());
-    return SASL_OK;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> parser(builder.newCharReader());
+    std::string errors;
+    if (!parser->parse(file.data(), file.data() + file.size(), &root,
+                       &errors)) {
+      log_->Write("TokenStore::Read: failed to parse file: %s", errors.c_str());
+      return SASL_FAIL;
+    }
+    TokenCache::Get()->Insert(key_, st, root);
+    format_ = FORMAT_JSON;
+    return remember_identity(ReadJson(root));
 
   } catch (const std::exception &e) {
     log_->Write("TokenStore::Read: exception=%s", e.what());
@@ -220,51 +855,255 @@ int TokenStore::Read() {
   }
 }
 
-int TokenStore::Write() {
-  const std::string new_path = path_ + "." + GetTempSuffix();
+int TokenStore::ReadJson(const Json::Value &root) {
+  if (!root.isMember("refresh_token")) {
+    log_->Write("TokenStore::Read: missing refresh_token");
+    return SASL_FAIL;
+  }
+
+  ReadOverride(root, "client_id", &override_client_id_);
+  ReadOverride(root, "client_secret", &override_client_secret_);
+  ReadOverride(root, "token_endpoint", &override_token_endpoint_);
+  ReadOverride(root, "hedge_token_endpoints",
+               &override_hedge_token_endpoints_);
+  ReadOverride(root, "proxy", &override_proxy_);
+  ReadOverride(root, "ca_bundle_file", &override_ca_bundle_file_);
+  ReadOverride(root, "ca_certs_dir", &override_ca_certs_dir_);
+  ReadOverride(root, "refresh_window", &override_refresh_window_);
+  DropLegacyRefreshWindow();
+  ReadOverride(root, "connect_timeout", &override_connect_timeout_);
+  ReadOverride(root, "request_timeout", &override_request_timeout_);
+  ReadOverride(root, "low_speed_limit", &override_low_speed_limit_);
+  ReadOverride(root, "low_speed_time", &override_low_speed_time_);
+  ReadOverride(root, "ip_family", &override_ip_family_);
+  ReadOverride(root, "happy_eyeballs_timeout_ms",
+               &override_happy_eyeballs_timeout_ms_);
+
+  refresh_ = root["refresh_token"].asString();
+  if (root.isMember("access_token")) access_ = root["access_token"].asString();
+  access_generation_++;
+  if (root.isMember("expiry")) expiry_ = stoi(root["expiry"].asString());
+
+  refresh_failures_ = root.isMember("refresh_failures")
+                          ? stoi(root["refresh_failures"].asString())
+                          : 0;
+  retry_after_ =
+      root.isMember("retry_after") ? stoll(root["retry_after"].asString()) : 0;
+  last_refresh_failure_ = root.isMember("last_refresh_failure")
+                              ? root["last_refresh_failure"].asString()
+                              : "";
+
+  ReadOverride(root, "user", &user_);
+
+  log_->Write("TokenStore::Read: refresh=%s, access=%s, user=%s",
+              refresh_.c_str(), access_.c_str(), user_.value_or("").c_str());
+  Metrics::SetTokenExpiry(path_, expiry_);
+  return SASL_OK;
+}
+
+void TokenStore::DropLegacyRefreshWindow() {
+  // Earlier versions wrote "refresh_window": "0" into every token file they
+  // updated, whether or not it was overridden, which would mask the
+  // configured refresh_window (and so async_refresh) for good. It's dropped,
+  // and so not written back.
+  if (override_refresh_window_ == 0) override_refresh_window_.reset();
+}
+
+int TokenStore::ReadBinary(const BinaryToken::Reader &reader) {
+  std::string_view value;
+  if (!reader.Get(BinaryToken::FIELD_REFRESH_TOKEN, &value)) {
+    log_->Write("TokenStore::Read: missing refresh_token");
+    return SASL_FAIL;
+  }
+  refresh_ = value;
+
+  ReadOverride(reader, BinaryToken::FIELD_CLIENT_ID, &override_client_id_);
+  ReadOverride(reader, BinaryToken::FIELD_CLIENT_SECRET,
+               &override_client_secret_);
+  ReadOverride(reader, BinaryToken::FIELD_TOKEN_ENDPOINT,
+               &override_token_endpoint_);
+  ReadOverride(reader, BinaryToken::FIELD_HEDGE_TOKEN_ENDPOINTS,
+               &override_hedge_token_endpoints_);
+  ReadOverride(reader, BinaryToken::FIELD_PROXY, &override_proxy_);
+  ReadOverride(reader, BinaryToken::FIELD_CA_BUNDLE_FILE,
+               &override_ca_bundle_file_);
+  ReadOverride(reader, BinaryToken::FIELD_CA_CERTS_DIR,
+               &override_ca_certs_dir_);
+  ReadOverride(reader, BinaryToken::FIELD_REFRESH_WINDOW,
+               &override_refresh_window_);
+  DropLegacyRefreshWindow();
+  ReadOverride(reader, BinaryToken::FIELD_CONNECT_TIMEOUT,
+               &override_connect_timeout_);
+  ReadOverride(reader, BinaryToken::FIELD_REQUEST_TIMEOUT,
+               &override_request_timeout_);
+  ReadOverride(reader, BinaryToken::FIELD_LOW_SPEED_LIMIT,
+               &override_low_speed_limit_);
+  ReadOverride(reader, BinaryToken::FIELD_LOW_SPEED_TIME,
+               &override_low_speed_time_);
+  ReadOverride(reader, BinaryToken::FIELD_IP_FAMILY, &override_ip_family_);
+  ReadOverride(reader, BinaryToken::FIELD_HAPPY_EYEBALLS_TIMEOUT_MS,
+               &override_happy_eyeballs_timeout_ms_);
 
+  if (reader.Get(BinaryToken::FIELD_ACCESS_TOKEN, &value)) access_ = value;
+  access_generation_++;
+  expiry_ = reader.expiry();
+
+  refresh_failures_ = reader.Get(BinaryToken::FIELD_REFRESH_FAILURES, &value)
+                          ? stoi(std::string(value))
+                          : 0;
+  retry_after_ = reader.Get(BinaryToken::FIELD_RETRY_AFTER, &value)
+                     ? stoll(std::string(value))
+                     : 0;
+  if (reader.Get(BinaryToken::FIELD_LAST_REFRESH_FAILURE, &value))
+    last_refresh_failure_ = value;
+  else
+    last_refresh_failure_.clear();
+
+  ReadOverride(reader, BinaryToken::FIELD_USER, &user_);
+
+  log_->Write("TokenStore::Read: (binary) refresh=%s, access=%s, user=%s",
+              refresh_.c_str(), access_.c_str(), user_.value_or("").c_str());
+  Metrics::SetTokenExpiry(path_, expiry_);
+  return SASL_OK;
+}
+
+int TokenStore::Write() {
   if (!enable_updates_) {
-    log_->Write("TokenStore::Write: skipping write to %s", new_path.c_str());
+    log_->Write("TokenStore::Write: skipping write to %s", path_.c_str());
     return SASL_OK;
   }
 
+  return WriteTo(path_, format_);
+}
+
+int TokenStore::Export(const std::string &path, Format format) {
+  return WriteTo(path, format);
+}
+
+int TokenStore::WriteTo(const std::string &path, Format format) {
+  const std::string new_path = path + "." + GetTempSuffix();
+
   try {
     Json::Value root;
-    root["refresh_token"] = refresh_;
-    root["access_token"] = access_;
-    root["expiry"] = std::to_string(expiry_);
+    std::string contents;
+
+    if (format == FORMAT_BINARY) {
+      BinaryToken::Writer writer;
+      writer.Set(BinaryToken::FIELD_REFRESH_TOKEN, refresh_);
+      writer.Set(BinaryToken::FIELD_ACCESS_TOKEN, access_);
+      writer.set_expiry(expiry_);
 
-    WriteOverride("user", user_, &root);
+      WriteOverride(BinaryToken::FIELD_USER, user_, &writer);
 
-    WriteOverride("client_id", override_client_id_, &root);
-    WriteOverride("client_secret", override_client_secret_, &root);
-    WriteOverride("token_endpoint", override_token_endpoint_, &root);
-    WriteOverride("proxy", override_proxy_, &root);
-    WriteOverride("ca_bundle_file", override_ca_bundle_file_, &root);
-    WriteOverride("ca_certs_dir", override_ca_certs_dir_, &root);
+      WriteOverride(BinaryToken::FIELD_CLIENT_ID, override_client_id_, &writer);
+      WriteOverride(BinaryToken::FIELD_CLIENT_SECRET, override_client_secret_,
+                    &writer);
+      WriteOverride(BinaryToken::FIELD_TOKEN_ENDPOINT,
+                    override_token_endpoint_, &writer);
+      WriteOverride(BinaryToken::FIELD_HEDGE_TOKEN_ENDPOINTS,
+                    override_hedge_token_endpoints_, &writer);
+      WriteOverride(BinaryToken::FIELD_PROXY, override_proxy_, &writer);
+      WriteOverride(BinaryToken::FIELD_CA_BUNDLE_FILE,
+                    override_ca_bundle_file_, &writer);
+      WriteOverride(BinaryToken::FIELD_CA_CERTS_DIR, override_ca_certs_dir_,
+                    &writer);
+      WriteOverride(BinaryToken::FIELD_REFRESH_WINDOW,
+                    override_refresh_window_, &writer);
+      WriteOverride(BinaryToken::FIELD_CONNECT_TIMEOUT,
+                    override_connect_timeout_, &writer);
+      WriteOverride(BinaryToken::FIELD_REQUEST_TIMEOUT,
+                    override_request_timeout_, &writer);
+      WriteOverride(BinaryToken::FIELD_LOW_SPEED_LIMIT,
+                    override_low_speed_limit_, &writer);
+      WriteOverride(BinaryToken::FIELD_LOW_SPEED_TIME,
+                    override_low_speed_time_, &writer);
+      WriteOverride(BinaryToken::FIELD_IP_FAMILY, override_ip_family_,
+                    &writer);
+      WriteOverride(BinaryToken::FIELD_HAPPY_EYEBALLS_TIMEOUT_MS,
+                    override_happy_eyeballs_timeout_ms_, &writer);
 
-    if (override_refresh_window_) {
-      root["refresh_window"] = std::to_string(*override_refresh_window_);
+      if (refresh_failures_ > 0) {
+        writer.Set(BinaryToken::FIELD_REFRESH_FAILURES,
+                   std::to_string(refresh_failures_));
+        writer.Set(BinaryToken::FIELD_RETRY_AFTER,
+                   std::to_string(retry_after_));
+        writer.Set(BinaryToken::FIELD_LAST_REFRESH_FAILURE,
+                   last_refresh_failure_);
+      }
+
+      contents = writer.Serialize();
+
+    } else {
+      root["refresh_token"] = refresh_;
+      root["access_token"] = access_;
+      root["expiry"] = std::to_string(expiry_);
+
+      WriteOverride("user", user_, &root);
+
+      WriteOverride("client_id", override_client_id_, &root);
+      WriteOverride("client_secret", override_client_secret_, &root);
+      WriteOverride("token_endpoint", override_token_endpoint_, &root);
+      WriteOverride("hedge_token_endpoints", override_hedge_token_endpoints_,
+                    &root);
+      WriteOverride("proxy", override_proxy_, &root);
+      WriteOverride("ca_bundle_file", override_ca_bundle_file_, &root);
+      WriteOverride("ca_certs_dir", override_ca_certs_dir_, &root);
+      WriteOverride("refresh_window", override_refresh_window_, &root);
+      WriteOverride("connect_timeout", override_connect_timeout_, &root);
+      WriteOverride("request_timeout", override_request_timeout_, &root);
+      WriteOverride("low_speed_limit", override_low_speed_limit_, &root);
+      WriteOverride("low_speed_time", override_low_speed_time_, &root);
+      WriteOverride("ip_family", override_ip_family_, &root);
+      WriteOverride("happy_eyeballs_timeout_ms",
+                    override_happy_eyeballs_timeout_ms_, &root);
+
+      if (refresh_failures_ > 0) {
+        root["refresh_failures"] = std::to_string(refresh_failures_);
+        root["retry_after"] = std::to_string(retry_after_);
+        root["last_refresh_failure"] = last_refresh_failure_;
+      }
+
+      std::ostringstream ss;
+      ss << root;
+      contents = ss.str();
     }
 
-    std::ofstream file(new_path);
-    if (!file.good()) {
+    FileDescriptor fd(openat(dir_fd_, new_path.c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (fd.get() < 0) {
       log_->Write("TokenStore::Write: failed to open file %s for writing: %s",
                   new_path.c_str(), strerror(errno));
       return SASL_FAIL;
     }
-    file << root;
+    if (!WriteAll(fd.get(), contents)) {
+      log_->Write("TokenStore::Write: failed to write file %s: %s",
+                  new_path.c_str(), strerror(errno));
+      unlinkat(dir_fd_, new_path.c_str(), 0);
+      return SASL_FAIL;
+    }
+
+    // The temporary file's identity (inode, mtime, etc.) survives the rename
+    // below, so it's safe to cache the contents under it now. Binary files
+    // are cheap enough to read that they aren't cached.
+    struct stat st = {};
+    if (format == FORMAT_JSON && fstat(fd.get(), &st) == 0) {
+      TokenCache::Get()->Insert(GetKey(dir_fd_, path), st, root);
+    } else {
+      TokenCache::Get()->Invalidate(GetKey(dir_fd_, path));
+    }
 
   } catch (const std::exception &e) {
     log_->Write("TokenStore::Write: exception=%s", e.what());
     return SASL_FAIL;
   }
 
-  if (rename(new_path.c_str(), path_.c_str()) != 0) {
+  if (renameat(dir_fd_, new_path.c_str(), dir_fd_, path.c_str()) != 0) {
     log_->Write("TokenStore::Write: rename failed with %s", strerror(errno));
+    TokenCache::Get()->Invalidate(GetKey(dir_fd_, path));
     return SASL_FAIL;
   }
 
+  Metrics::Increment(Metrics::TOKEN_WRITES);
   return 0;
 }
 
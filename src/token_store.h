@@ -17,52 +17,181 @@
 #ifndef SASL_XOAUTH2_TOKEN_STORE_H
 #define SASL_XOAUTH2_TOKEN_STORE_H
 
+#include <json/json.h>
+#include <stdint.h>
 #include <time.h>
 
+#include <chrono>
 #include <memory>
 #include <optional>
 #include <string>
+#include <vector>
+
+#include "binary_token.h"
+#include "http.h"
+#include "token_cache.h"
 
 namespace sasl_xoauth2 {
 
 class Log;
+class TokenResponseParser;
 
 class TokenStore {
  public:
+  enum Format {
+    FORMAT_JSON,
+    FORMAT_BINARY,  // See binary_token.h.
+  };
+
   static std::unique_ptr<TokenStore> Create(Log *log, const std::string &path,
                                             bool enable_updates = true);
+  // Like Create(), but |name| is resolved against the directory open at
+  // |dir_fd| (which must outlive the TokenStore).
+  static std::unique_ptr<TokenStore> CreateAt(Log *log, int dir_fd,
+                                              const std::string &name,
+                                              bool enable_updates = true);
+
+  // Returns true for files that live alongside token files but aren't tokens
+  // themselves (lock files, in-progress writes).
+  static bool IsAuxiliaryFile(const std::string &path);
+
+  // Re-reads the token file for a new session, unless it is unchanged since
+  // this store last read it.
+  int Reload();
+  bool IsFile(int dir_fd, const std::string &name) const {
+    return dir_fd == dir_fd_ && name == path_;
+  }
 
   int GetAccessToken(std::string *token);
+  // Points |response| at the XOAUTH2 initial client response for |user|,
+  // which is only rebuilt when the access token (or user) changes. It stays
+  // valid until the next call that may refresh the token.
+  int GetInitialResponse(const std::string &user, const std::string **response);
   int Refresh();
+  // Like Refresh(), but connecting and the request together may take at most
+  // |time_limit| seconds.
+  int RefreshWithin(int time_limit);
+  // Returns true if the token expires within |seconds|.
+  bool ExpiresWithin(int seconds) const;
+
+  // Writes the token to |path| in |format|, regardless of whether updates are
+  // enabled. |path| may be the token's own path, and is resolved the same way.
+  int Export(const std::string &path, Format format);
 
   std::string user() const { return user_.value_or(""); }
   bool has_user() const { return user_.has_value(); }
+  time_t expiry() const { return expiry_; }
 
  private:
-  TokenStore(Log *log, const std::string &path, bool enable_updates);
-
+  TokenStore(Log *log, int dir_fd, const std::string &path,
+             bool enable_updates);
+
+  // The token's overrides where present, and the config's values otherwise.
+  // Resolved after each read, so that using them copies nothing; they point
+  // into the overrides below and the (never freed) Config snapshot.
+  struct Settings {
+    const std::string *client_id = nullptr;
+    const std::string *client_secret = nullptr;
+    const std::string *token_endpoint = nullptr;
+    const std::vector<std::string> *hedge_token_endpoints = nullptr;
+    const std::string *proxy = nullptr;
+    const std::string *ca_bundle_file = nullptr;
+    const std::string *ca_certs_dir = nullptr;
+    int refresh_window = 0;
+    HttpTransportOptions transport;
+  };
+
+  // Refreshes the access token if needed.
+  int PrepareAccessToken();
+  // Adopts a newer access token from SharedTokenCache, if there is one.
+  bool ReadSharedToken();
+  bool NeedsRefresh() const;
+  // Returns true (and logs why) if refreshes are backing off after failures.
+  bool BackingOff() const;
+  // Records a failed refresh (of class |failure|) and returns |err|.
+  int RefreshFailed(const char *failure, int err);
+  bool CanRefreshInBackground() const;
+  // Returns true if a refresh fits the refresh rate limit, waiting up to
+  // |max_wait| for it to.
+  bool WithinRateLimit(std::chrono::milliseconds max_wait) const;
+
+  void StartBackgroundRefresh();
+  int RefreshWithFileLock();
+  int RefreshFromServer();
+  std::string MakeRefreshRequest() const;
+  void LogTimings(const HttpTimings &timings) const;
+  // Parses |result| with |parser|, feeding it the response first if it
+  // hasn't already been fed.
+  int HandleRefreshResponse(const HttpResult &result,
+                            TokenResponseParser *parser);
+  int UpdateToken(const std::string &access_token, long expires_in,
+                  const std::string *refresh_token);
+
+  void ResolveSettings();
   int Read();
+  int ReadJson(const Json::Value &root);
+  int ReadBinary(const BinaryToken::Reader &reader);
+  void DropLegacyRefreshWindow();
+
   int Write();
+  int WriteTo(const std::string &path, Format format);
 
   Log *const log_ = nullptr;
+  const int dir_fd_;
   const std::string path_;
+  // Identifies the token file process-wide (for the cache, etc.).
+  const std::string key_;
+  const std::string shared_key_;
   const bool enable_updates_;
+  Format format_ = FORMAT_JSON;  // Preserved on writes.
 
   // Normally these values come from the config file, but they can be overriden.
   std::optional<std::string> override_client_id_;
   std::optional<std::string> override_client_secret_;
   std::optional<std::string> override_token_endpoint_;
+  std::optional<std::string> override_hedge_token_endpoints_;
   std::optional<std::string> override_proxy_;
   std::optional<std::string> override_ca_bundle_file_;
   std::optional<std::string> override_ca_certs_dir_;
-  std::optional<int> override_refresh_window_ = 0;
+  std::optional<int> override_refresh_window_;
+  std::optional<int> override_connect_timeout_;
+  std::optional<int> override_request_timeout_;
+  std::optional<int> override_low_speed_limit_;
+  std::optional<int> override_low_speed_time_;
+  std::optional<std::string> override_ip_family_;
+  std::optional<int> override_happy_eyeballs_timeout_ms_;
+
+  Settings settings_;
+  // Parsed from override_hedge_token_endpoints_.
+  std::vector<std::string> hedge_token_endpoints_;
 
   std::string access_;
+  // Bumped whenever access_ is assigned.
+  uint64_t access_generation_ = 0;
   std::string refresh_;
   std::optional<std::string> user_;
   time_t expiry_ = 0;
 
+  // Consecutive failed refreshes, persisted so that other processes (and
+  // later messages) back off too.
+  int refresh_failures_ = 0;
+  time_t retry_after_ = 0;
+  std::string last_refresh_failure_;
+
   int refresh_attempts_ = 0;
+  // If non-zero, caps the time refresh requests may take, in seconds.
+  int refresh_time_limit_ = 0;
+
+  // Scratch space for ReadSharedToken().
+  std::string shared_access_;
+
+  std::string initial_response_;
+  std::string initial_response_user_;
+  uint64_t initial_response_generation_ = 0;
+
+  // The file the fields above were last read from, if they haven't been
+  // updated since.
+  std::optional<TokenCache::FileIdentity> identity_;
 };
 
 }  // namespace sasl_xoauth2
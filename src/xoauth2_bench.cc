@@ -0,0 +1,300 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for the per-authentication cost of the plugin. Drives the
+// plugin through its SASL entry points, with the network stubbed out, and
+// reports time and heap allocations per authentication.
+
+#include <json/json.h>
+#include <sasl/sasl.h>
+#include <sasl/saslplug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include "config.h"
+#include "http.h"
+#include "module.h"
+#include "token_response.h"
+
+namespace {
+
+std::atomic<uint64_t> s_allocations = 0;
+
+}  // namespace
+
+// Count every heap allocation in the process, including those made by the
+// plugin library.
+void *operator new(size_t size) {
+  s_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace {
+
+const std::string kUserName = "abc@def.com";
+
+constexpr char kTempFileTemplate[] = "/tmp/sasl_xoauth2_bench_token.XXXXXX";
+constexpr char kTokenTemplate[] =
+    R"({"access_token": "%s", "refresh_token": "%s", "expiry": "%s",
+        "refresh_window": "%d"})";
+
+constexpr char kServerTokenExpired[] =
+    R"({"status":"401","schemes":"Bearer","scope":"https://mail.google.com/"})";
+
+std::string s_token_path;
+
+// A token endpoint response of typical size and shape.
+std::string MakeTokenResponse() {
+  return R"({"access_token": ")" + std::string(1200, 'a') +
+         R"(", "expires_in": 3599, "refresh_token": ")" +
+         std::string(100, 'r') +
+         R"(", "scope": "https://mail.google.com/", "token_type": "Bearer",
+            "id_token": ")" +
+         std::string(900, 'i') + R"("})";
+}
+
+bool ParseWithStreamingParser(const std::string &response) {
+  sasl_xoauth2::TokenResponseParser parser;
+  parser.Feed(response.data(), response.size());
+  return parser.Finish() && parser.has_access_token() &&
+         parser.expires_in() == 3599;
+}
+
+bool ParseWithJsoncpp(const std::string &response) {
+  std::stringstream ss(response);
+  Json::Value root;
+  ss >> root;
+  return root.isMember("access_token") &&
+         stoi(root["expires_in"].asString()) == 3599;
+}
+
+void WriteTokenFile(time_t expiry, int refresh_window) {
+  FILE *f = fopen(s_token_path.c_str(), "w");
+  const std::string expiry_str = std::to_string(expiry);
+  fprintf(f, kTokenTemplate, "access", "refresh", expiry_str.c_str(),
+          refresh_window);
+  fclose(f);
+}
+
+void FakeFree(void *ptr) { free(ptr); }
+
+void *FakeMalloc(size_t size) { return malloc(size); }
+
+int FakeGetAuthName(void *, int, const char **result, unsigned int *len) {
+  *result = kUserName.c_str();
+  *len = kUserName.size();
+  return SASL_OK;
+}
+
+int FakeGetPassword(sasl_conn_t *, void *, int, sasl_secret_t **pass) {
+  // Reuse one buffer; the plugin doesn't take ownership.
+  static sasl_secret_t *s_secret = nullptr;
+  if (!s_secret) {
+    s_secret = static_cast<sasl_secret_t *>(
+        malloc(sizeof(sasl_secret_t) + s_token_path.size() + 1));
+    s_secret->len = s_token_path.size();
+    strcpy(reinterpret_cast<char *>(s_secret->data), s_token_path.c_str());
+  }
+  *pass = s_secret;
+  return SASL_OK;
+}
+
+int FakeGetCallback(sasl_conn_t *, unsigned long id, sasl_callback_ft *ft,
+                    void **) {
+  if (id == SASL_CB_AUTHNAME)
+    *ft = reinterpret_cast<sasl_callback_ft>(&FakeGetAuthName);
+  else if (id == SASL_CB_PASS)
+    *ft = reinterpret_cast<sasl_callback_ft>(&FakeGetPassword);
+  else
+    return SASL_FAIL;
+  return SASL_OK;
+}
+
+int FakeCanonUser(sasl_conn_t *, const char *, unsigned int, unsigned int,
+                  sasl_out_params_t *) {
+  return SASL_OK;
+}
+
+int RefreshIntercept(sasl_xoauth2::HttpPostOptions options, int expires_in) {
+  *options.response = R"({"access_token": "refreshed_access", "expires_in": )" +
+                      std::to_string(expires_in) + "}";
+  *options.response_code = 200;
+  return SASL_OK;
+}
+
+class Bench {
+ public:
+  explicit Bench(sasl_client_plug_t plug) : plug_(plug) {
+    utils_.free = &FakeFree;
+    utils_.malloc = &FakeMalloc;
+    utils_.getcallback = &FakeGetCallback;
+    params_.utils = &utils_;
+    params_.canon_user = &FakeCanonUser;
+  }
+
+  // One full authentication in which the server accepts the token.
+  bool Authenticate() {
+    void *context = nullptr;
+    if (plug_.mech_new(nullptr, &params_, &context) != SASL_OK) return false;
+    const char *to_server = nullptr;
+    unsigned int to_server_len = 0;
+    sasl_out_params_t out_params = {};
+    bool ok = plug_.mech_step(context, &params_, nullptr, 0, nullptr,
+                              &to_server, &to_server_len,
+                              &out_params) == SASL_OK &&
+              plug_.mech_step(context, &params_, "", 0, nullptr, &to_server,
+                              &to_server_len, &out_params) == SASL_OK;
+    plug_.mech_dispose(context, &utils_);
+    return ok;
+  }
+
+  // One authentication in which the server rejects the token as expired.
+  bool AuthenticateWithRetry() {
+    void *context = nullptr;
+    if (plug_.mech_new(nullptr, &params_, &context) != SASL_OK) return false;
+    const char *to_server = nullptr;
+    unsigned int to_server_len = 0;
+    sasl_out_params_t out_params = {};
+    bool ok = plug_.mech_step(context, &params_, nullptr, 0, nullptr,
+                              &to_server, &to_server_len,
+                              &out_params) == SASL_OK &&
+              plug_.mech_step(context, &params_, kServerTokenExpired,
+                              sizeof(kServerTokenExpired) - 1, nullptr,
+                              &to_server, &to_server_len,
+                              &out_params) == SASL_TRYAGAIN;
+    plug_.mech_dispose(context, &utils_);
+    return ok;
+  }
+
+ private:
+  sasl_client_plug_t plug_;
+  sasl_utils_t utils_ = {};
+  sasl_client_params_t params_ = {};
+};
+
+bool Run(const char *name, int iterations, const std::function<bool()> &op) {
+  // Warm up caches (and the plugin's own state) before measuring.
+  for (int i = 0; i < iterations / 10 + 1; i++) {
+    if (!op()) {
+      fprintf(stderr, "%s: operation failed\n", name);
+      return false;
+    }
+  }
+
+  const uint64_t start_allocations = s_allocations;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    if (!op()) {
+      fprintf(stderr, "%s: operation failed\n", name);
+      return false;
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+  const uint64_t allocations = s_allocations - start_allocations;
+
+  const double ns =
+      std::chrono::duration<double, std::nano>(end - start).count();
+  printf("%-24s %10d %14.0f %14.1f\n", name, iterations, ns / iterations,
+         static_cast<double>(allocations) / iterations);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int iterations = 10000;
+  if (argc > 1) iterations = atoi(argv[1]);
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Json::Value config;
+  config["client_id"] = "dummy client id";
+  config["client_secret"] = "dummy client secret";
+  config["log_to_syslog_on_failure"] = "no";
+  sasl_xoauth2::Config::EnableLoggingToStderr();
+  if (sasl_xoauth2::Config::InitForTesting(config) != SASL_OK)
+    return EXIT_FAILURE;
+
+  sasl_utils_t utils = {};
+  int version = 0;
+  sasl_client_plug_t *plug_list = nullptr;
+  int plug_count = 0;
+  if (sasl_client_plug_init(&utils, SASL_CLIENT_PLUG_VERSION, &version,
+                            &plug_list, &plug_count) != SASL_OK) {
+    return EXIT_FAILURE;
+  }
+
+  char temp_template[sizeof(kTempFileTemplate)];
+  strcpy(temp_template, kTempFileTemplate);
+  close(mkstemp(temp_template));
+  s_token_path = temp_template;
+
+  Bench bench(*plug_list);
+  bool ok = true;
+
+  printf("%-24s %10s %14s %14s\n", "benchmark", "iterations", "ns/op",
+         "allocs/op");
+
+  // Token is valid throughout; no refresh.
+  WriteTokenFile(time(nullptr) + 3600, 10);
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [](sasl_xoauth2::HttpPostOptions) { return SASL_FAIL; });
+  ok = ok &&
+       Run("cached_token", iterations, [&] { return bench.Authenticate(); });
+
+  // Refreshed tokens expire within the refresh window, so every
+  // authentication refreshes (and rewrites the token file).
+  WriteTokenFile(0, 3600);
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [](sasl_xoauth2::HttpPostOptions options) {
+        return RefreshIntercept(options, 1);
+      });
+  ok = ok && Run("refresh", iterations / 10 + 1,
+                 [&] { return bench.Authenticate(); });
+
+  // Token looks valid, but the server rejects it.
+  WriteTokenFile(time(nullptr) + 3600, 10);
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [](sasl_xoauth2::HttpPostOptions options) {
+        return RefreshIntercept(options, 3600);
+      });
+  ok = ok && Run("server_401_retry", iterations / 10 + 1,
+                 [&] { return bench.AuthenticateWithRetry(); });
+
+  // Parsing a token endpoint response, as done for every refresh.
+  const std::string response = MakeTokenResponse();
+  ok = ok && Run("parse_response_streaming", iterations,
+                 [&] { return ParseWithStreamingParser(response); });
+  ok = ok && Run("parse_response_jsoncpp", iterations,
+                 [&] { return ParseWithJsoncpp(response); });
+
+  unlink(s_token_path.c_str());
+  unlink((s_token_path + ".lock").c_str());
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
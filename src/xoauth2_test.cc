@@ -12,24 +12,59 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <json/json.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <sasl/sasl.h>
 #include <sasl/saslplug.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "ca_certificates.h"
+#include "circuit_breaker.h"
 #include "config.h"
 #include "http.h"
 #include "log.h"
+#include "metrics.h"
 #include "module.h"
+#include "rate_limiter.h"
+#include "server_challenge.h"
+#include "shared_region.h"
+#include "shared_token_cache.h"
+#include "token_cache.h"
+#include "token_index.h"
+#include "token_response.h"
 #include "token_store.h"
 
+std::atomic<uint64_t> s_allocations = 0;
+
+// Count heap allocations, for tests that check for copies.
+void *operator new(size_t size) {
+  s_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
 const std::string kUserName = "abc@def.com";
 
 constexpr char kTempFileTemplate[] = "/tmp/sasl_xoauth2_test_token.XXXXXX";
@@ -102,6 +137,7 @@ void SetPasswordToInvalidPath() { s_password = "/tmp/this/path/is/not/valid"; }
 void Cleanup() {
   for (const auto &file : s_cleanup_files) {
     unlink(file.c_str());
+    unlink((file + ".lock").c_str());
   }
 }
 
@@ -111,6 +147,110 @@ int DefaultHttpIntercept(sasl_xoauth2::HttpPostOptions options) {
   return SASL_FAIL;
 }
 
+// Answers token requests on a loopback port, by path: /slow responds after
+// kSlowResponseMs (unless the client hangs up first), /unavailable with a 503,
+// and anything else at once, with the path as the access token.
+class FakeTokenServer {
+ public:
+  static constexpr int kSlowResponseMs = 5000;
+
+  ~FakeTokenServer() {
+    if (fd_ < 0) return;
+    shutdown(fd_, SHUT_RDWR);
+    thread_.join();
+    close(fd_);
+  }
+
+  bool Start() {
+    fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd_ < 0 ||
+        bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(fd_, 16) != 0 ||
+        getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &len) != 0)
+      return false;
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this] { Serve(); });
+    return true;
+  }
+
+  std::string url(const std::string &path) const {
+    return "http://127.0.0.1:" + std::to_string(port_) + path;
+  }
+
+  int requests(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_[path];
+  }
+
+  int abandoned() const { return abandoned_; }
+
+ private:
+  void Serve() {
+    std::vector<std::thread> handlers;
+    for (;;) {
+      const int conn = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (conn < 0) break;
+      handlers.emplace_back([this, conn] {
+        Handle(conn);
+        close(conn);
+      });
+    }
+    for (auto &handler : handlers) handler.join();
+  }
+
+  void Handle(int conn) {
+    std::string request;
+    char buffer[4096];
+    ssize_t n;
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           (n = recv(conn, buffer, sizeof(buffer), 0)) > 0)
+      request.append(buffer, n);
+    const size_t path_start = request.find(' ') + 1;
+    const std::string path =
+        request.substr(path_start, request.find(' ', path_start) - path_start);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_[path]++;
+    }
+
+    std::string status = "200 OK";
+    std::string body = R"({"access_token": ")" + path.substr(1) +
+                       R"(", "expires_in": 3600})";
+    if (path == "/slow") {
+      // The request body may still be arriving; anything after it means the
+      // client has hung up.
+      pollfd pfd = {conn, POLLIN, 0};
+      while (poll(&pfd, 1, kSlowResponseMs) > 0) {
+        if (recv(conn, buffer, sizeof(buffer), 0) <= 0) {
+          abandoned_++;
+          return;
+        }
+      }
+    } else if (path == "/unavailable") {
+      status = "503 Service Unavailable";
+      body = "{}";
+    }
+
+    const std::string response =
+        "HTTP/1.1 " + status +
+        "\r\nContent-Type: application/json\r\nConnection: close\r\n"
+        "Content-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+    send(conn, response.data(), response.size(), MSG_NOSIGNAL);
+  }
+
+  int fd_ = -1;
+  int port_ = 0;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::map<std::string, int> requests_;
+  std::atomic<int> abandoned_ = 0;
+};
+
 #define TEST_ABORT(x)                                                     \
   do {                                                                    \
     bool __result = (x);                                                  \
@@ -625,6 +765,1379 @@ bool TestFailedPreemptiveTokenRefresh(sasl_client_plug_t plug) {
   return true;
 }
 
+bool TestClientReuse(sasl_client_plug_t plug) {
+  PrintTestName(__func__);
+  const std::string kUserNameOverride = "override@foo.com";
+  SetPasswordToValidTokenWithUserOverride(kUserNameOverride);
+  sasl_xoauth2::SetHttpInterceptForTesting(&DefaultHttpIntercept);
+
+  sasl_utils_t utils = {};
+  utils.free = &FakeFree;
+  utils.getcallback = &FakeGetCallbackAll;
+  utils.malloc = &FakeMalloc;
+
+  sasl_client_params_t params = {};
+  params.utils = &utils;
+  params.canon_user = &FakeCanonUser;
+
+  const char *to_server = nullptr;
+  unsigned int to_server_len = 0;
+  sasl_out_params_t out_params = {};
+
+  void *first_context = nullptr;
+  TEST_ASSERT_OK(plug.mech_new(nullptr, nullptr, &first_context));
+  TEST_ASSERT_OK(plug.mech_step(first_context, &params, nullptr, 0, nullptr,
+                                &to_server, &to_server_len, &out_params));
+  TEST_ASSERT(strstr(to_server, kUserNameOverride.c_str()) != nullptr);
+  plug.mech_dispose(first_context, &utils);
+
+  // Rewrite the same token file; the recycled Client must notice.
+  FILE *f = fopen(s_password.c_str(), "w");
+  const std::string expiry_str = std::to_string(time(nullptr) + 3600);
+  fprintf(f, kTokenTemplate, "new_access", "refresh", expiry_str.c_str());
+  fclose(f);
+
+  void *context = nullptr;
+  TEST_ASSERT_OK(plug.mech_new(nullptr, nullptr, &context));
+  PlugCleanup _(&utils, plug, context);
+  TEST_ASSERT(context == first_context);
+
+  TEST_ASSERT_OK(plug.mech_step(context, &params, nullptr, 0, nullptr,
+                                &to_server, &to_server_len, &out_params));
+  fprintf(stderr, "to_server=[%s], len=%d\n", to_server, to_server_len);
+  TEST_ASSERT(strstr(to_server, "new_access") != nullptr);
+  TEST_ASSERT(strstr(to_server, kUserName.c_str()) != nullptr);
+  TEST_ASSERT(strstr(to_server, kUserNameOverride.c_str()) == nullptr);
+
+  TEST_ASSERT_OK(plug.mech_step(context, &params, "", 0, nullptr, &to_server,
+                                &to_server_len, &out_params));
+  TEST_ASSERT(to_server_len == 0);
+
+  return true;
+}
+
+bool TestRefreshBackoff() {
+  PrintTestName(__func__);
+  SetPasswordToExpiredToken();
+
+  int requests = 0;
+  int response_code = 400;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&requests, &response_code](sasl_xoauth2::HttpPostOptions options) {
+        requests++;
+        *options.response_code = response_code;
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        return SASL_OK;
+      });
+
+  auto read_token_file = [](Json::Value *root) {
+    std::ifstream file(s_password);
+    file >> *root;
+  };
+
+  auto log = sasl_xoauth2::Log::Create();
+  std::string token;
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT(store->GetAccessToken(&token) != SASL_OK);
+  TEST_ASSERT(requests == 1);
+
+  Json::Value root;
+  read_token_file(&root);
+  TEST_ASSERT(root["refresh_failures"].asString() == "1");
+  TEST_ASSERT(root["last_refresh_failure"].asString() == "rejected");
+  const time_t retry_after = stoll(root["retry_after"].asString());
+  TEST_ASSERT(retry_after >= time(nullptr) + 4);
+  TEST_ASSERT(retry_after <= time(nullptr) + 10);
+
+  // Later stores (other messages, other processes) fail without a request.
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT(store->GetAccessToken(&token) != SASL_OK);
+  TEST_ASSERT(requests == 1);
+
+  // But a token that hasn't yet expired is still used.
+  root["expiry"] = std::to_string(time(nullptr) + 5);
+  {
+    std::ofstream file(s_password);
+    file << root;
+  }
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == root["access_token"].asString());
+  TEST_ASSERT(requests == 1);
+
+  // Once the backoff has passed, a successful refresh clears it.
+  root["expiry"] = "0";
+  root["refresh_failures"] = "3";
+  root["retry_after"] = "1";
+  {
+    std::ofstream file(s_password);
+    file << root;
+  }
+  response_code = 200;
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "refreshed_access");
+  TEST_ASSERT(requests == 2);
+  read_token_file(&root);
+  TEST_ASSERT(!root.isMember("refresh_failures"));
+  TEST_ASSERT(!root.isMember("retry_after"));
+
+  return true;
+}
+
+bool TestTokenCache() {
+  PrintTestName(__func__);
+  SetPasswordToValidToken();
+  sasl_xoauth2::SetHttpInterceptForTesting(&DefaultHttpIntercept);
+
+  auto log = sasl_xoauth2::Log::Create();
+  auto *cache = sasl_xoauth2::TokenCache::Get();
+  const auto initial = cache->stats();
+
+  TEST_ASSERT(sasl_xoauth2::TokenStore::Create(log.get(), s_password) != nullptr);
+  TEST_ASSERT(cache->stats().misses == initial.misses + 1);
+  TEST_ASSERT(cache->stats().hits == initial.hits);
+
+  TEST_ASSERT(sasl_xoauth2::TokenStore::Create(log.get(), s_password) != nullptr);
+  TEST_ASSERT(cache->stats().misses == initial.misses + 1);
+  TEST_ASSERT(cache->stats().hits == initial.hits + 1);
+
+  // Rewriting the file in place must invalidate the cached entry.
+  FILE *f = fopen(s_password.c_str(), "w");
+  fprintf(f, kTokenTemplate, "rewritten_access", "refresh", "0");
+  fclose(f);
+
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [](sasl_xoauth2::HttpPostOptions options) {
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT(cache->stats().misses == initial.misses + 2);
+
+  // Refreshing re-reads the file under the refresh lock (a hit), then writes
+  // through the cache, so the next read is a hit too.
+  std::string token;
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "refreshed_access");
+
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT(cache->stats().misses == initial.misses + 2);
+  TEST_ASSERT(cache->stats().hits == initial.hits + 3);
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "refreshed_access");
+
+  return true;
+}
+
+bool TestFailedReloadDropsOverrides() {
+  PrintTestName(__func__);
+  SetPasswordToExpiredTokenWithOtherOverrides("http://foo.com", "");
+
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password,
+                                                /*enable_updates=*/false);
+  TEST_ASSERT(store != nullptr);
+
+  // Reloading resets the token's overrides; failing to read the file again
+  // must leave the store using the config's values rather than the (freed)
+  // overrides.
+  FILE *f = fopen(s_password.c_str(), "w");
+  fprintf(f, "invalid");
+  fclose(f);
+  TEST_ASSERT(store->Reload() != SASL_OK);
+
+  const sasl_xoauth2::Config *config = sasl_xoauth2::Config::Get();
+  bool used_config = false;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [config, &used_config](sasl_xoauth2::HttpPostOptions options) {
+        used_config = &options.url == &config->token_endpoint();
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+  TEST_ASSERT_OK(store->Refresh());
+  TEST_ASSERT(used_config);
+
+  return true;
+}
+
+bool TestRefreshThatThrows() {
+  PrintTestName(__func__);
+  SetPasswordToExpiredToken();
+
+  int requests = 0;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&requests](sasl_xoauth2::HttpPostOptions options) {
+        if (requests++ == 0) throw std::runtime_error("intercept");
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  auto log = sasl_xoauth2::Log::Create();
+  std::string token;
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  bool thrown = false;
+  try {
+    store->GetAccessToken(&token);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  TEST_ASSERT(thrown);
+
+  // The failed refresh isn't left in flight for the next one to wait on.
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "refreshed_access");
+  TEST_ASSERT(requests == 2);
+
+  return true;
+}
+
+bool TestRefreshDoesNotCopySettings() {
+  PrintTestName(__func__);
+
+  const sasl_xoauth2::Config *config = sasl_xoauth2::Config::Get();
+  const uint64_t initial_allocations = s_allocations;
+  size_t total_size = 0;
+  for (int i = 0; i < 100; i++) {
+    total_size += config->client_id().size() + config->client_secret().size() +
+                  config->token_endpoint().size() + config->proxy().size() +
+                  config->ca_bundle_file().size() +
+                  config->ca_certs_dir().size();
+  }
+  TEST_ASSERT(total_size > 0);
+  TEST_ASSERT(s_allocations == initial_allocations);
+
+  // The request refers to the config's strings rather than copies of them.
+  bool settings_shared = false;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [config, &settings_shared](sasl_xoauth2::HttpPostOptions options) {
+        settings_shared = &options.url == &config->token_endpoint() &&
+                          &options.proxy == &config->proxy() &&
+                          &options.ca_bundle_file == &config->ca_bundle_file() &&
+                          &options.ca_certs_dir == &config->ca_certs_dir();
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  SetPasswordToExpiredToken();
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->Refresh());
+  TEST_ASSERT(settings_shared);
+
+  return true;
+}
+
+bool TestTransportOptions() {
+  PrintTestName(__func__);
+
+  FILE *f = OpenTempTokenFile();
+  fprintf(f, R"({"access_token": "access", "refresh_token": "refresh",
+                 "expiry": "0", "connect_timeout": "3",
+                 "ip_family": "ipv6", "happy_eyeballs_timeout_ms": "50"})");
+  fclose(f);
+
+  sasl_xoauth2::HttpTransportOptions transport;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&transport](sasl_xoauth2::HttpPostOptions options) {
+        transport = options.transport;
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  // The token's overrides win; everything else comes from the config.
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->Refresh());
+  TEST_ASSERT(transport.connect_timeout == 3);
+  TEST_ASSERT(transport.request_timeout ==
+              sasl_xoauth2::Config::Get()->transport().request_timeout);
+  TEST_ASSERT(transport.request_timeout > 0);
+  TEST_ASSERT(transport.low_speed_limit == 0);
+  TEST_ASSERT(transport.ip_family ==
+              sasl_xoauth2::HttpTransportOptions::IP_FAMILY_V6);
+  TEST_ASSERT(transport.happy_eyeballs_timeout_ms == 50);
+
+  // Overrides survive a round trip through the binary format.
+  TEST_ASSERT_OK(
+      store->Export(s_password, sasl_xoauth2::TokenStore::FORMAT_BINARY));
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  transport = {};
+  TEST_ASSERT_OK(store->Refresh());
+  TEST_ASSERT(transport.connect_timeout == 3);
+  TEST_ASSERT(transport.ip_family ==
+              sasl_xoauth2::HttpTransportOptions::IP_FAMILY_V6);
+  TEST_ASSERT(transport.happy_eyeballs_timeout_ms == 50);
+
+  return true;
+}
+
+bool TestInitialResponse() {
+  PrintTestName(__func__);
+  SetPasswordToValidToken();
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [](sasl_xoauth2::HttpPostOptions options) {
+        *options.response =
+            R"({"access_token": "refreshed", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+
+  const std::string *response = nullptr;
+  TEST_ASSERT_OK(store->GetInitialResponse(kUserName, &response));
+  TEST_ASSERT(*response == "user=" + kUserName + "\1auth=Bearer access\1\1");
+
+  // Reused as-is while the token is unchanged.
+  const uint64_t initial_allocations = s_allocations;
+  const std::string *again = nullptr;
+  TEST_ASSERT_OK(store->GetInitialResponse(kUserName, &again));
+  TEST_ASSERT(s_allocations == initial_allocations);
+  TEST_ASSERT(again == response);
+
+  TEST_ASSERT_OK(store->Refresh());
+  TEST_ASSERT_OK(store->GetInitialResponse(kUserName, &response));
+  TEST_ASSERT(response->find("auth=Bearer refreshed\1") != std::string::npos);
+
+  TEST_ASSERT_OK(store->GetInitialResponse("other@def.com", &response));
+  TEST_ASSERT(response->find("user=other@def.com\1") == 0);
+
+  return true;
+}
+
+bool TestTokenResponseParser() {
+  PrintTestName(__func__);
+
+  const std::string response =
+      R"({"access_token": "ya29.a\/b\"c", "expires_in": 3599,
+          "scope": "https://mail.google.com/", "token_type": "Bearer",
+          "extra": {"nested": ["}", {"a": "\"]"}], "n": null},
+          "refresh_token": "1//refresh", "ignored": "\u00e9"})";
+
+  // Fed a byte at a time, as it might arrive.
+  sasl_xoauth2::TokenResponseParser parser;
+  for (char c : response) parser.Feed(&c, 1);
+  TEST_ASSERT(parser.Finish());
+  TEST_ASSERT(parser.access_token() == "ya29.a/b\"c");
+  TEST_ASSERT(parser.expires_in() == 3599);
+  TEST_ASSERT(parser.has_refresh_token());
+  TEST_ASSERT(parser.refresh_token() == "1//refresh");
+
+  sasl_xoauth2::TokenResponseParser no_refresh;
+  const std::string no_refresh_response =
+      R"({"expires_in": "3600", "ok": true, "access_token": "access"})";
+  no_refresh.Feed(no_refresh_response.data(), no_refresh_response.size());
+  TEST_ASSERT(no_refresh.Finish());
+  TEST_ASSERT(no_refresh.access_token() == "access");
+  TEST_ASSERT(no_refresh.expires_in() == 3600);
+  TEST_ASSERT(!no_refresh.has_refresh_token());
+
+  // Unsupported input is left to jsoncpp.
+  sasl_xoauth2::TokenResponseParser unicode;
+  const std::string unicode_response =
+      R"({"access_token": "refreshed\u005faccess", "expires_in": 3600})";
+  unicode.Feed(unicode_response.data(), unicode_response.size());
+  TEST_ASSERT(!unicode.Finish());
+
+  SetPasswordToExpiredToken();
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&unicode_response](sasl_xoauth2::HttpPostOptions options) {
+        *options.response = unicode_response;
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  std::string token;
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "refreshed_access");
+
+  return true;
+}
+
+bool TestServerChallenge() {
+  PrintTestName(__func__);
+
+  sasl_xoauth2::ServerChallenge challenge;
+  // Servers may include the C string terminator in the challenge length.
+  TEST_ASSERT(sasl_xoauth2::ScanServerChallenge(
+      kServerTokenExpired, sizeof(kServerTokenExpired), &challenge));
+  TEST_ASSERT(challenge.status == "401");
+  TEST_ASSERT(challenge.schemes == "Bearer");
+  TEST_ASSERT(challenge.scope == "https://mail.google.com/");
+  // Fields point into the challenge rather than copying it.
+  TEST_ASSERT(challenge.scope.data() >= kServerTokenExpired &&
+              challenge.scope.data() <
+                  kServerTokenExpired + sizeof(kServerTokenExpired));
+
+  const std::string numeric = R"( { "status" : 400, "extra": null } )";
+  TEST_ASSERT(sasl_xoauth2::ScanServerChallenge(numeric.data(), numeric.size(),
+                                                &challenge));
+  TEST_ASSERT(challenge.status == "400");
+  TEST_ASSERT(challenge.schemes.empty());
+
+  const std::string empty = "{}";
+  TEST_ASSERT(
+      sasl_xoauth2::ScanServerChallenge(empty.data(), empty.size(), &challenge));
+  TEST_ASSERT(challenge.status.empty());
+
+  // A null status is as good as none, but a quoted one isn't.
+  const std::string null_status = R"({"status":null, "scope": "null"})";
+  TEST_ASSERT(sasl_xoauth2::ScanServerChallenge(
+      null_status.data(), null_status.size(), &challenge));
+  TEST_ASSERT(challenge.status.empty());
+  TEST_ASSERT(challenge.scope == "null");
+
+  // Escapes, nesting, and malformed input are left to jsoncpp.
+  for (const std::string bad :
+       {R"({"status":"40\u0031"})", R"({"status":"401","x":{}})",
+        R"({"status":"401")", R"({"status":"401"} x)", "not json"}) {
+    TEST_ASSERT(
+        !sasl_xoauth2::ScanServerChallenge(bad.data(), bad.size(), &challenge));
+  }
+
+  return true;
+}
+
+bool TestConcurrentRefreshIsCoalesced() {
+  PrintTestName(__func__);
+  SetPasswordToExpiredToken();
+
+  std::atomic<int> intercept_calls = 0;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&intercept_calls](sasl_xoauth2::HttpPostOptions options) {
+        intercept_calls++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  auto log_a = sasl_xoauth2::Log::Create();
+  auto log_b = sasl_xoauth2::Log::Create();
+  auto store_a = sasl_xoauth2::TokenStore::Create(log_a.get(), s_password);
+  auto store_b = sasl_xoauth2::TokenStore::Create(log_b.get(), s_password);
+  TEST_ASSERT(store_a != nullptr);
+  TEST_ASSERT(store_b != nullptr);
+
+  std::string token_a, token_b;
+  int err_a = SASL_FAIL, err_b = SASL_FAIL;
+  std::thread thread_a([&] { err_a = store_a->GetAccessToken(&token_a); });
+  std::thread thread_b([&] { err_b = store_b->GetAccessToken(&token_b); });
+  thread_a.join();
+  thread_b.join();
+
+  TEST_ASSERT_OK(err_a);
+  TEST_ASSERT_OK(err_b);
+  TEST_ASSERT(token_a == "refreshed_access");
+  TEST_ASSERT(token_b == "refreshed_access");
+  TEST_ASSERT(intercept_calls == 1);
+
+  return true;
+}
+
+bool TestBinaryTokenFormat() {
+  const std::string kUserNameOverride = "override@foo.com";
+
+  PrintTestName(__func__);
+  SetPasswordToValidTokenWithUserOverride(kUserNameOverride);
+
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  const time_t expiry = store->expiry();
+  TEST_ASSERT_OK(
+      store->Export(s_password, sasl_xoauth2::TokenStore::FORMAT_BINARY));
+
+  char magic[8] = {};
+  FILE *f = fopen(s_password.c_str(), "r");
+  TEST_ASSERT(fread(magic, 1, sizeof(magic), f) == sizeof(magic));
+  fclose(f);
+  TEST_ASSERT(memcmp(magic, "SXOAUTH2", sizeof(magic)) == 0);
+
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT(store->user() == kUserNameOverride);
+  TEST_ASSERT(store->expiry() == expiry);
+  std::string token;
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "access");
+
+  // Refreshing preserves the binary format.
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [](sasl_xoauth2::HttpPostOptions options) {
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+  TEST_ASSERT_OK(store->Refresh());
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "refreshed_access");
+  TEST_ASSERT(store->user() == kUserNameOverride);
+
+  // A corrupted file fails its checksum.
+  f = fopen(s_password.c_str(), "r+");
+  fseek(f, -1, SEEK_END);
+  fputc('!', f);
+  fclose(f);
+  TEST_ASSERT(sasl_xoauth2::TokenStore::Create(log.get(), s_password) ==
+              nullptr);
+
+  return true;
+}
+
+// Points the config at a new file holding |json|, and loads it.
+bool LoadTestConfig(const char *json) {
+  char config_template[] = "/tmp/sasl_xoauth2_test_config.XXXXXX";
+  const int fd = mkstemp(config_template);
+  if (fd < 0) return false;
+  s_cleanup_files.push_back(config_template);
+  const bool written = write(fd, json, strlen(json)) ==
+                       static_cast<ssize_t>(strlen(json));
+  close(fd);
+  if (!written) return false;
+  if (sasl_xoauth2::Config::WatchForTesting(config_template) != SASL_OK)
+    return false;
+  sasl_xoauth2::Config::RequestReload();
+  sasl_xoauth2::Config::MaybeReload();
+  return true;
+}
+
+constexpr char kDefaultTestConfig[] =
+    R"({"client_id": "dummy client id", "client_secret": "dummy client secret"})";
+
+bool TestBackgroundRefresh() {
+  PrintTestName(__func__);
+  TEST_ASSERT(LoadTestConfig(
+      R"({"client_id": "dummy client id", "client_secret": "dummy client secret",
+          "async_refresh": "yes"})"));
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->async_refresh());
+
+  // Valid, but within the (default, 10 second) refresh window. Earlier
+  // versions wrote a zero refresh_window into every token file, which
+  // mustn't mask the default.
+  FILE *f = OpenTempTokenFile();
+  const std::string expiry_str = std::to_string(time(nullptr) + 5);
+  fprintf(f, R"({"access_token": "access", "refresh_token": "refresh",
+                 "expiry": "%s", "refresh_window": "0"})",
+          expiry_str.c_str());
+  fclose(f);
+
+  std::atomic<int> intercept_calls = 0;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&intercept_calls](sasl_xoauth2::HttpPostOptions options) {
+        intercept_calls++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  // The current token is returned without waiting for the refresh, and a
+  // second request doesn't start another one.
+  auto log = sasl_xoauth2::Log::Create();
+  std::string token;
+  for (int i = 0; i < 2; i++) {
+    auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+    TEST_ASSERT(store != nullptr);
+    TEST_ASSERT_OK(store->GetAccessToken(&token));
+    TEST_ASSERT(token == "access");
+  }
+
+  for (int i = 0; i < 100 && token != "refreshed_access"; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+    TEST_ASSERT(store != nullptr);
+    TEST_ASSERT_OK(store->GetAccessToken(&token));
+  }
+  TEST_ASSERT(token == "refreshed_access");
+  TEST_ASSERT(intercept_calls == 1);
+
+  // Nor is it written back.
+  Json::Value root;
+  std::ifstream(s_password) >> root;
+  TEST_ASSERT(!root.isMember("refresh_window"));
+
+  TEST_ASSERT(LoadTestConfig(kDefaultTestConfig));
+  TEST_ASSERT(!sasl_xoauth2::Config::Get()->async_refresh());
+  return true;
+}
+
+class CapturingLogImpl : public sasl_xoauth2::LogImpl {
+ public:
+  explicit CapturingLogImpl(std::vector<std::string> *lines) : lines_(lines) {}
+
+  void WriteLine(const std::string &line) override { lines_->push_back(line); }
+
+ private:
+  std::vector<std::string> *lines_;
+};
+
+class CapturingLog : public sasl_xoauth2::Log {
+ public:
+  CapturingLog(std::vector<std::string> *lines, Options options)
+      : Log(std::make_unique<CapturingLogImpl>(lines), options) {}
+};
+
+bool TestBufferedLog() {
+  PrintTestName(__func__);
+
+  const std::string long_line(20000, 'x');
+  std::vector<std::string> lines;
+  {
+    CapturingLog log(&lines, sasl_xoauth2::Log::OPTIONS_FULL_TRACE_ON_FAILURE);
+    for (int i = 0; i < 200; i++) log.Write("line %d", i);
+    log.Write("long: %s", long_line.c_str());
+    log.Write("last");
+    TEST_ASSERT(lines.empty());
+    log.Flush();
+  }
+
+  TEST_ASSERT(lines.size() == 203);
+  TEST_ASSERT(lines[0] == "auth failed:");
+  TEST_ASSERT(lines[1].find(": line 0") != std::string::npos);
+  TEST_ASSERT(lines[200].find(": line 199") != std::string::npos);
+  TEST_ASSERT(lines[201].find(": long: " + long_line) != std::string::npos);
+  TEST_ASSERT(lines[202].find(": last") != std::string::npos);
+
+  lines.clear();
+  {
+    CapturingLog log(&lines, sasl_xoauth2::Log::OPTIONS_NONE);
+    log.Write("first");
+    log.Write("summary %s", "line");
+    log.SetFlushOnDestroy();
+    log.Write("trailing");
+  }
+
+  TEST_ASSERT(lines.size() == 2);
+  TEST_ASSERT(lines[0].find("auth failed: ") == 0);
+  TEST_ASSERT(lines[0].find(": summary line") != std::string::npos);
+
+  return true;
+}
+
+bool TestTokenIndex() {
+  PrintTestName(__func__);
+
+  char dir_template[] = "/tmp/sasl_xoauth2_test_dir.XXXXXX";
+  TEST_ASSERT(mkdtemp(dir_template) != nullptr);
+  const std::string dir = dir_template;
+  const std::string expiry_str = std::to_string(time(nullptr) + 3600);
+  auto write_token = [&](const std::string &name, const char *user) {
+    const std::string path = dir + "/" + name;
+    s_cleanup_files.push_back(path);
+    FILE *f = fopen((path + ".tmp").c_str(), "w");
+    if (user) {
+      fprintf(f, kTokenTemplateWithUser, name.c_str(), "refresh",
+              expiry_str.c_str(), user);
+    } else {
+      fprintf(f, kTokenTemplate, name.c_str(), "refresh", expiry_str.c_str());
+    }
+    fclose(f);
+    rename((path + ".tmp").c_str(), path.c_str());
+  };
+
+  write_token("alice@example.com", nullptr);
+  write_token("bob", "bob@example.com");
+
+  std::string error;
+  auto index = sasl_xoauth2::TokenIndex::Create(dir, &error);
+  TEST_ASSERT(index != nullptr);
+
+  std::string name;
+  TEST_ASSERT(index->Lookup("alice@example.com", &name));
+  TEST_ASSERT(name == "alice@example.com");
+  TEST_ASSERT(index->Lookup("bob@example.com", &name));
+  TEST_ASSERT(name == "bob");
+  TEST_ASSERT(!index->Lookup("bob", &name));
+  TEST_ASSERT(!index->Lookup("carol@example.com", &name));
+
+  // Changes to the directory are picked up without a rescan.
+  write_token("carol", "carol@example.com");
+  TEST_ASSERT(index->Lookup("carol@example.com", &name));
+  TEST_ASSERT(name == "carol");
+  unlink((dir + "/alice@example.com").c_str());
+  TEST_ASSERT(!index->Lookup("alice@example.com", &name));
+
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::CreateAt(log.get(), index->dir_fd(),
+                                                  name);
+  TEST_ASSERT(store != nullptr);
+  std::string token;
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "carol");
+
+  index.reset();
+  Cleanup();
+  TEST_ASSERT(rmdir(dir.c_str()) == 0);
+  return true;
+}
+
+bool TestMetrics() {
+  PrintTestName(__func__);
+
+  FILE *f = OpenTempTokenFile();
+  fclose(f);
+  const std::string metrics_path = s_password;
+  TEST_ASSERT_OK(sasl_xoauth2::Metrics::Init(metrics_path));
+
+  SetPasswordToExpiredToken();
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [](sasl_xoauth2::HttpPostOptions options) {
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  std::string token;
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+
+  std::string metrics, error;
+  TEST_ASSERT_OK(sasl_xoauth2::Metrics::Render(metrics_path, &metrics, &error));
+  TEST_ASSERT(metrics.find("sasl_xoauth2_refresh_attempts_total 1\n") !=
+              std::string::npos);
+  TEST_ASSERT(metrics.find("sasl_xoauth2_refresh_successes_total 1\n") !=
+              std::string::npos);
+  TEST_ASSERT(metrics.find("sasl_xoauth2_refresh_failures_total 0\n") !=
+              std::string::npos);
+  TEST_ASSERT(metrics.find("sasl_xoauth2_token_writes_total 1\n") !=
+              std::string::npos);
+  // The refresh re-reads the file it has just read.
+  TEST_ASSERT(metrics.find("sasl_xoauth2_token_cache_hits_total 1\n") !=
+              std::string::npos);
+  TEST_ASSERT(metrics.find("sasl_xoauth2_token_cache_misses_total 1\n") !=
+              std::string::npos);
+  TEST_ASSERT(metrics.find("sasl_xoauth2_http_request_duration_seconds_bucket{"
+                           "le=\"+Inf\"} 1\n") != std::string::npos);
+  TEST_ASSERT(metrics.find("sasl_xoauth2_token_expiry_seconds{token=\"" +
+                           s_password + "\"} 3") != std::string::npos);
+
+  // Files from before the rate limiter (and token cache) counters can still be
+  // read, without first being extended.
+  std::ifstream in(metrics_path, std::ios::binary);
+  std::string contents((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+  f = OpenTempTokenFile();
+  fwrite(contents.data(), 1, contents.size() - 4 * sizeof(uint64_t), f);
+  fclose(f);
+  TEST_ASSERT_OK(sasl_xoauth2::Metrics::Render(s_password, &metrics, &error));
+  TEST_ASSERT(metrics.find("sasl_xoauth2_refresh_attempts_total 1\n") !=
+              std::string::npos);
+  TEST_ASSERT(metrics.find("sasl_xoauth2_refreshes_delayed_total 0\n") !=
+              std::string::npos);
+
+  return true;
+}
+
+bool TestSharedTokenCache() {
+  PrintTestName(__func__);
+
+  FILE *f = OpenTempTokenFile();
+  fclose(f);
+  TEST_ASSERT_OK(sasl_xoauth2::SharedTokenCache::Init(s_password));
+
+  std::string access;
+  time_t expiry = 0;
+  sasl_xoauth2::SharedTokenCache::Publish("key", "refresh", "access", 100);
+  TEST_ASSERT(sasl_xoauth2::SharedTokenCache::Lookup("key", "refresh", &access,
+                                                     &expiry));
+  TEST_ASSERT(access == "access" && expiry == 100);
+  TEST_ASSERT(!sasl_xoauth2::SharedTokenCache::Lookup("key", "other refresh",
+                                                      &access, &expiry));
+  TEST_ASSERT(!sasl_xoauth2::SharedTokenCache::Lookup("other key", "refresh",
+                                                      &access, &expiry));
+
+  // Oversized tokens aren't shared.
+  sasl_xoauth2::SharedTokenCache::Publish("key", "refresh",
+                                          std::string(5000, 'x'), 200);
+  TEST_ASSERT(sasl_xoauth2::SharedTokenCache::Lookup("key", "refresh", &access,
+                                                     &expiry));
+  TEST_ASSERT(access == "access" && expiry == 100);
+
+  // An update in progress hides the entry, and isn't interrupted...
+  sasl_xoauth2::SharedTokenCache::AbandonPublishForTesting("key", 0);
+  TEST_ASSERT(!sasl_xoauth2::SharedTokenCache::Lookup("key", "refresh",
+                                                      &access, &expiry));
+  sasl_xoauth2::SharedTokenCache::Publish("key", "refresh", "newer", 200);
+  TEST_ASSERT(!sasl_xoauth2::SharedTokenCache::Lookup("key", "refresh",
+                                                      &access, &expiry));
+  // ...unless its publisher has presumably died.
+  sasl_xoauth2::SharedTokenCache::AbandonPublishForTesting("key", 120);
+  sasl_xoauth2::SharedTokenCache::Publish("key", "refresh", "newer", 200);
+  TEST_ASSERT(sasl_xoauth2::SharedTokenCache::Lookup("key", "refresh", &access,
+                                                     &expiry));
+  TEST_ASSERT(access == "newer" && expiry == 200);
+
+  // A token refreshed by one store is picked up by another, even though
+  // neither writes the token file.
+  SetPasswordToExpiredToken();
+  int requests = 0;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&requests](sasl_xoauth2::HttpPostOptions options) {
+        requests++;
+        *options.response =
+            R"({"access_token": "shared_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+  auto log = sasl_xoauth2::Log::Create();
+  auto store_a = sasl_xoauth2::TokenStore::Create(log.get(), s_password,
+                                                  /*enable_updates=*/false);
+  auto store_b = sasl_xoauth2::TokenStore::Create(log.get(), s_password,
+                                                  /*enable_updates=*/false);
+  TEST_ASSERT(store_a != nullptr && store_b != nullptr);
+
+  std::string token;
+  TEST_ASSERT_OK(store_a->GetAccessToken(&token));
+  TEST_ASSERT(token == "shared_access");
+  TEST_ASSERT_OK(store_b->GetAccessToken(&token));
+  TEST_ASSERT(token == "shared_access");
+  TEST_ASSERT(requests == 1);
+
+  sasl_xoauth2::SharedTokenCache::ResetForTesting();
+  return true;
+}
+
+bool TestSharedSlotTable() {
+  PrintTestName(__func__);
+
+  struct Slot {
+    std::atomic<uint32_t> state;
+    uint32_t key_length;
+    char key[8];
+    int value;
+  };
+  using Table = sasl_xoauth2::SharedSlotTable<Slot, 4>;
+
+  auto table = std::make_unique<Table>();
+  TEST_ASSERT(table->Find("a", /*claim=*/false) == nullptr);
+  Slot *a = table->Find("a", /*claim=*/true);
+  TEST_ASSERT(a != nullptr);
+  TEST_ASSERT(table->Find("a", /*claim=*/false) == a);
+  TEST_ASSERT(table->Find("too long a key", /*claim=*/true) == nullptr);
+  TEST_ASSERT(table->Find("b", /*claim=*/true) != nullptr);
+  TEST_ASSERT(table->Find("c", /*claim=*/true) != nullptr);
+  TEST_ASSERT(table->Find("d", /*claim=*/true) != nullptr);
+  TEST_ASSERT(table->Find("e", /*claim=*/true) == nullptr);
+  TEST_ASSERT(table->Find("a", /*claim=*/true) == a);
+
+  // Claims abandoned by an earlier version are taken over.
+  table = std::make_unique<Table>();
+  for (Slot &slot : table->slots) slot.state = 1;
+  TEST_ASSERT(table->Find("a", /*claim=*/false) == nullptr);
+  a = table->Find("a", /*claim=*/true);
+  TEST_ASSERT(a != nullptr);
+  TEST_ASSERT(Table::HasKey(*a));
+  TEST_ASSERT(table->Find("a", /*claim=*/false) == a);
+
+  return true;
+}
+
+bool TestCircuitBreaker() {
+  PrintTestName(__func__);
+
+  FILE *f = OpenTempTokenFile();
+  fclose(f);
+  TEST_ASSERT_OK(sasl_xoauth2::CircuitBreaker::Init(s_password));
+
+  const std::string endpoint = "https://breaker.example.com/token";
+  for (int i = 0; i < 5; i++) {
+    TEST_ASSERT(sasl_xoauth2::CircuitBreaker::Allow(endpoint));
+    sasl_xoauth2::CircuitBreaker::Record(endpoint, /*healthy=*/false);
+  }
+  TEST_ASSERT(!sasl_xoauth2::CircuitBreaker::Allow(endpoint));
+  TEST_ASSERT(sasl_xoauth2::CircuitBreaker::IsOpen(endpoint));
+  TEST_ASSERT(sasl_xoauth2::CircuitBreaker::Allow("https://example.com/token"));
+
+  int requests = 0;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&requests](sasl_xoauth2::HttpPostOptions options) {
+        requests++;
+        return SASL_FAIL;
+      });
+
+  // A token in its refresh window is used until it expires.
+  const std::string expiry_str = std::to_string(time(nullptr) + 5);
+  f = OpenTempTokenFile();
+  fprintf(f, kTokenTemplateWithOverrides, "access", "refresh",
+          expiry_str.c_str(), endpoint.c_str(), "secret");
+  fclose(f);
+  auto log = sasl_xoauth2::Log::Create();
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  std::string token;
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "access");
+
+  // An expired one can't be, but the failure isn't held against the token.
+  SetPasswordToExpiredTokenWithOtherOverrides(endpoint, "secret");
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT(store->GetAccessToken(&token) == SASL_UNAVAIL);
+  std::ifstream file(s_password);
+  Json::Value root;
+  file >> root;
+  TEST_ASSERT(!root.isMember("refresh_failures"));
+
+  TEST_ASSERT(requests == 0);
+
+  sasl_xoauth2::CircuitBreaker::ResetForTesting();
+  return true;
+}
+
+bool TestHedgedRequest() {
+  PrintTestName(__func__);
+  // Real requests, to a local server.
+  sasl_xoauth2::SetHttpInterceptForTesting({});
+  setenv("no_proxy", "127.0.0.1", 1);
+  FakeTokenServer server;
+  TEST_ASSERT(server.Start());
+
+  auto post = [&server](const std::string &path, const std::string &hedge_path,
+                        std::string *response) {
+    const std::string url = server.url(path);
+    const std::vector<std::string> hedge_urls = {server.url(hedge_path)};
+    const std::string data = "grant_type=refresh_token";
+    const std::string empty;
+    long response_code = 0;
+    std::string error;
+    const int err = sasl_xoauth2::HttpPost({.url = url,
+                                            .data = data,
+                                            .proxy = empty,
+                                            .ca_bundle_file = empty,
+                                            .ca_certs_dir = empty,
+                                            .response_code = &response_code,
+                                            .response = response,
+                                            .error = &error,
+                                            .hedge_urls = &hedge_urls});
+    if (err != SASL_OK) fprintf(stderr, "TEST: error=%s\n", error.c_str());
+    return err == SASL_OK && response_code == 200;
+  };
+
+  // A prompt endpoint isn't hedged.
+  std::string response;
+  TEST_ASSERT(post("/primary", "/hedge", &response));
+  TEST_ASSERT(response.find("\"primary\"") != std::string::npos);
+  TEST_ASSERT(server.requests("/hedge") == 0);
+
+  // A slow one is, and loses.
+  const auto start = std::chrono::steady_clock::now();
+  TEST_ASSERT(post("/slow", "/hedge", &response));
+  TEST_ASSERT(response.find("\"hedge\"") != std::string::npos);
+  TEST_ASSERT(std::chrono::steady_clock::now() - start <
+              std::chrono::milliseconds(FakeTokenServer::kSlowResponseMs));
+  for (int i = 0; i < 100 && server.abandoned() == 0; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  TEST_ASSERT(server.abandoned() == 1);
+
+  // A failing one is hedged at once.
+  TEST_ASSERT(post("/unavailable", "/hedge", &response));
+  TEST_ASSERT(response.find("\"hedge\"") != std::string::npos);
+  TEST_ASSERT(server.requests("/unavailable") == 1);
+  TEST_ASSERT(server.requests("/hedge") == 2);
+
+  unsetenv("no_proxy");
+  return true;
+}
+
+bool TestHttpTimings() {
+  PrintTestName(__func__);
+  sasl_xoauth2::SetHttpInterceptForTesting({});
+  setenv("no_proxy", "127.0.0.1", 1);
+  FakeTokenServer server;
+  TEST_ASSERT(server.Start());
+
+  auto post = [&server](const std::vector<std::string> *hedge_urls,
+                        sasl_xoauth2::HttpTimings *timings) {
+    const std::string url = server.url("/primary");
+    const std::string data = "grant_type=refresh_token";
+    const std::string empty;
+    long response_code = 0;
+    std::string response, error;
+    const int err = sasl_xoauth2::HttpPost({.url = url,
+                                            .data = data,
+                                            .proxy = empty,
+                                            .ca_bundle_file = empty,
+                                            .ca_certs_dir = empty,
+                                            .response_code = &response_code,
+                                            .response = &response,
+                                            .error = &error,
+                                            .hedge_urls = hedge_urls,
+                                            .timings = timings});
+    return err == SASL_OK && response_code == 200;
+  };
+
+  auto check = [](const sasl_xoauth2::HttpTimings &timings) {
+    // No TLS over plain HTTP.
+    return timings.total.count() > 0 &&
+           timings.name_lookup <= timings.connect &&
+           timings.app_connect.count() == 0 &&
+           timings.connect <= timings.pre_transfer &&
+           timings.pre_transfer <= timings.start_transfer &&
+           timings.start_transfer <= timings.total &&
+           !timings.connection_reused && !timings.proxied;
+  };
+
+  sasl_xoauth2::HttpTimings timings;
+  TEST_ASSERT(post(nullptr, &timings));
+  TEST_ASSERT(check(timings));
+
+  const std::vector<std::string> hedge_urls = {server.url("/hedge")};
+  timings = {};
+  TEST_ASSERT(post(&hedge_urls, &timings));
+  TEST_ASSERT(check(timings));
+
+  unsetenv("no_proxy");
+  return true;
+}
+
+bool TestStopHttpAsync(sasl_client_plug_t plug) {
+  PrintTestName(__func__);
+  TEST_ASSERT(plug.mech_free != nullptr);
+  sasl_xoauth2::SetHttpInterceptForTesting({});
+  setenv("no_proxy", "127.0.0.1", 1);
+  FakeTokenServer server;
+  TEST_ASSERT(server.Start());
+
+  std::mutex mutex;
+  std::condition_variable done;
+  std::vector<sasl_xoauth2::HttpResult> results;
+  auto post = [&](const std::string &path) {
+    const std::string empty;
+    sasl_xoauth2::HttpPostAsync(
+        {.url = server.url(path),
+         .data = "grant_type=refresh_token",
+         .proxy = empty,
+         .ca_bundle_file = empty,
+         .ca_certs_dir = empty,
+         .response_code = nullptr,
+         .response = nullptr,
+         .error = nullptr},
+        [&](const sasl_xoauth2::HttpResult &result) {
+          std::lock_guard<std::mutex> lock(mutex);
+          results.push_back(result);
+          done.notify_all();
+        });
+  };
+  auto wait_for = [&](size_t count) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return done.wait_for(lock, std::chrono::seconds(2),
+                         [&] { return results.size() >= count; });
+  };
+
+  // Unloading the plugin cancels requests in flight, without waiting for
+  // them.
+  post("/slow");
+  for (int i = 0; i < 100 && server.requests("/slow") == 0; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  const auto start = std::chrono::steady_clock::now();
+  plug.mech_free(nullptr, nullptr);
+  TEST_ASSERT(std::chrono::steady_clock::now() - start <
+              std::chrono::milliseconds(FakeTokenServer::kSlowResponseMs));
+  TEST_ASSERT(wait_for(1));
+  TEST_ASSERT(results[0].err == SASL_UNAVAIL);
+
+  // Later requests start over.
+  post("/primary");
+  TEST_ASSERT(wait_for(2));
+  TEST_ASSERT(results[1].err == SASL_OK);
+  TEST_ASSERT(results[1].response_code == 200);
+
+  sasl_xoauth2::StopHttpAsync();
+  unsetenv("no_proxy");
+  return true;
+}
+
+bool TestCaCertificates() {
+  PrintTestName(__func__);
+
+  constexpr char kFirst[] = "-----BEGIN CERTIFICATE-----\nfirst\n";
+  constexpr char kSecond[] = "-----BEGIN CERTIFICATE-----\nsecond\n";
+
+  char dir_template[] = "/tmp/sasl_xoauth2_test_dir.XXXXXX";
+  TEST_ASSERT(mkdtemp(dir_template) != nullptr);
+  const std::string dir = dir_template;
+  auto write_file = [&](const std::string &name, const char *contents) {
+    const std::string path = dir + "/" + name;
+    s_cleanup_files.push_back(path);
+    FILE *f = fopen(path.c_str(), "w");
+    fputs(contents, f);
+    fclose(f);
+  };
+  write_file("first.pem", kFirst);
+  write_file("second.pem", kSecond);
+  write_file("README", "not a certificate\n");
+  // A hashed name for an existing certificate is only read once.
+  s_cleanup_files.push_back(dir + "/1234abcd.0");
+  TEST_ASSERT(symlink("first.pem", (dir + "/1234abcd.0").c_str()) == 0);
+
+  TEST_ASSERT_OK(sasl_xoauth2::CaCertificates::Init("", dir));
+  const std::string *certificates = sasl_xoauth2::CaCertificates::Find(dir);
+  TEST_ASSERT(certificates != nullptr);
+  TEST_ASSERT(*certificates == std::string(kFirst) + kSecond);
+
+  const std::string bundle = dir + "/second.pem";
+  TEST_ASSERT_OK(sasl_xoauth2::CaCertificates::Init(bundle, ""));
+  certificates = sasl_xoauth2::CaCertificates::Find(bundle);
+  TEST_ASSERT(certificates != nullptr);
+  TEST_ASSERT(*certificates == kSecond);
+
+  // A missing source leaves curl to read the path itself.
+  const std::string missing = dir + "/missing.pem";
+  TEST_ASSERT(sasl_xoauth2::CaCertificates::Init(missing, "") == SASL_FAIL);
+  TEST_ASSERT(sasl_xoauth2::CaCertificates::Find(missing) == nullptr);
+
+  sasl_xoauth2::CaCertificates::ResetForTesting();
+  TEST_ASSERT(sasl_xoauth2::CaCertificates::Find(dir) == nullptr);
+  Cleanup();
+  TEST_ASSERT(rmdir(dir.c_str()) == 0);
+  return true;
+}
+
+bool TestConfigReload() {
+  PrintTestName(__func__);
+
+  static constexpr char kConfigTemplate[] =
+      R"({"client_id": "%s", "client_secret": "dummy client secret",
+          "async_refresh": "yes", "refresh_window": "%d"})";
+  auto write_config = [](const char *client_id, int refresh_window) {
+    FILE *f = fopen(s_password.c_str(), "w");
+    fprintf(f, kConfigTemplate, client_id, refresh_window);
+    fclose(f);
+  };
+
+  FILE *f = OpenTempTokenFile();
+  fclose(f);
+  TEST_ASSERT_OK(sasl_xoauth2::Config::WatchForTesting(s_password));
+
+  const sasl_xoauth2::Config *initial = sasl_xoauth2::Config::Get();
+  write_config("reloaded client id", 77);
+  sasl_xoauth2::Config::MaybeReload();
+  TEST_ASSERT(sasl_xoauth2::Config::Get() != initial);
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->client_id() == "reloaded client id");
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->refresh_window() == 77);
+  // Earlier snapshots are unchanged, and still usable.
+  TEST_ASSERT(initial->client_id() == "dummy client id");
+
+  // Invalid configs are ignored.
+  f = fopen(s_password.c_str(), "w");
+  fprintf(f, "{}");
+  fclose(f);
+  sasl_xoauth2::Config::RequestReload();
+  sasl_xoauth2::Config::MaybeReload();
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->client_id() == "reloaded client id");
+
+  write_config("dummy client id", 10);
+  sasl_xoauth2::Config::RequestReload();
+  sasl_xoauth2::Config::MaybeReload();
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->client_id() == "dummy client id");
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->refresh_window() == 10);
+
+  return true;
+}
+
+bool TestIdleRefresh(sasl_client_plug_t plug) {
+  PrintTestName(__func__);
+  TEST_ASSERT(plug.idle != nullptr);
+
+  static constexpr char kConfigTemplate[] =
+      R"({"client_id": "dummy client id", "client_secret": "dummy client secret",
+          "idle_refresh_margin": "%d"})";
+  char config_template[] = "/tmp/sasl_xoauth2_test_config.XXXXXX";
+  close(mkstemp(config_template));
+  const std::string config_path = config_template;
+  s_cleanup_files.push_back(config_path);
+  auto set_margin = [&config_path](int margin) {
+    FILE *f = fopen(config_path.c_str(), "w");
+    fprintf(f, kConfigTemplate, margin);
+    fclose(f);
+    sasl_xoauth2::Config::RequestReload();
+    sasl_xoauth2::Config::MaybeReload();
+  };
+  TEST_ASSERT_OK(sasl_xoauth2::Config::WatchForTesting(config_path));
+  set_margin(300);
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->idle_refresh_margin() == 300);
+
+  // Outside the refresh window, but inside the idle refresh margin.
+  FILE *f = OpenTempTokenFile();
+  const std::string expiry_str = std::to_string(time(nullptr) + 60);
+  fprintf(f, kTokenTemplate, "access", "refresh", expiry_str.c_str());
+  fclose(f);
+
+  int requests = 0;
+  int request_timeout = 0;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&requests, &request_timeout](sasl_xoauth2::HttpPostOptions options) {
+        requests++;
+        request_timeout = options.transport.request_timeout;
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  sasl_utils_t utils = {};
+  utils.free = &FakeFree;
+  utils.getcallback = &FakeGetCallbackAll;
+  utils.malloc = &FakeMalloc;
+
+  sasl_client_params_t params = {};
+  params.utils = &utils;
+  params.canon_user = &FakeCanonUser;
+
+  const char *to_server = nullptr;
+  unsigned int to_server_len = 0;
+  sasl_out_params_t out_params = {};
+
+  void *context = nullptr;
+  TEST_ASSERT_OK(plug.mech_new(nullptr, nullptr, &context));
+  TEST_ASSERT_OK(plug.mech_step(context, &params, nullptr, 0, nullptr,
+                                &to_server, &to_server_len, &out_params));
+  TEST_ASSERT(strstr(to_server, "auth=Bearer access") != nullptr);
+  plug.mech_dispose(context, &utils);
+  TEST_ASSERT(requests == 0);
+
+  // The disposed Client's token is refreshed, within the time limit.
+  TEST_ASSERT(plug.idle(nullptr, nullptr, nullptr) == 1);
+  TEST_ASSERT(requests >= 1);
+  TEST_ASSERT(request_timeout > 0);
+  TEST_ASSERT(request_timeout <=
+              sasl_xoauth2::Config::Get()->idle_refresh_timeout());
+  // Nothing is left to do.
+  TEST_ASSERT(plug.idle(nullptr, nullptr, nullptr) == 0);
+
+  // So the next session finds a fresh token.
+  requests = 0;
+  context = nullptr;
+  TEST_ASSERT_OK(plug.mech_new(nullptr, nullptr, &context));
+  TEST_ASSERT_OK(plug.mech_step(context, &params, nullptr, 0, nullptr,
+                                &to_server, &to_server_len, &out_params));
+  TEST_ASSERT(strstr(to_server, "auth=Bearer refreshed_access") != nullptr);
+  plug.mech_dispose(context, &utils);
+  TEST_ASSERT(requests == 0);
+
+  // Idle refreshes are off by default.
+  set_margin(0);
+  TEST_ASSERT(plug.idle(nullptr, nullptr, nullptr) == 0);
+
+  return true;
+}
+
+bool TestRateLimiter() {
+  PrintTestName(__func__);
+
+  FILE *f = OpenTempTokenFile();
+  fclose(f);
+  TEST_ASSERT_OK(sasl_xoauth2::RateLimiter::Init(s_password));
+
+  // 10 tokens a second, in bursts of up to 2.
+  const std::chrono::milliseconds no_wait(0);
+  TEST_ASSERT(sasl_xoauth2::RateLimiter::Acquire("key", 600, 2, no_wait));
+  TEST_ASSERT(sasl_xoauth2::RateLimiter::Acquire("key", 600, 2, no_wait));
+  TEST_ASSERT(!sasl_xoauth2::RateLimiter::Acquire("key", 600, 2, no_wait));
+  TEST_ASSERT(sasl_xoauth2::RateLimiter::Acquire("other key", 600, 2, no_wait));
+  TEST_ASSERT(sasl_xoauth2::RateLimiter::Acquire(
+      "key", 600, 2, std::chrono::milliseconds(500)));
+
+  // One refresh a minute, for the rest of the test.
+  char config_template[] = "/tmp/sasl_xoauth2_test_config.XXXXXX";
+  close(mkstemp(config_template));
+  const std::string config_path = config_template;
+  s_cleanup_files.push_back(config_path);
+  TEST_ASSERT_OK(sasl_xoauth2::Config::WatchForTesting(config_path));
+  f = fopen(config_path.c_str(), "w");
+  fprintf(f, R"({"client_id": "dummy client id",
+                 "client_secret": "dummy client secret",
+                 "refresh_rate_limit": "1", "refresh_rate_burst": "1"})");
+  fclose(f);
+  sasl_xoauth2::Config::RequestReload();
+  sasl_xoauth2::Config::MaybeReload();
+  TEST_ASSERT(sasl_xoauth2::Config::Get()->refresh_rate_limit() == 1);
+
+  int requests = 0;
+  sasl_xoauth2::SetHttpInterceptForTesting(
+      [&requests](sasl_xoauth2::HttpPostOptions options) {
+        requests++;
+        *options.response =
+            R"({"access_token": "refreshed_access", "expires_in": 3600})";
+        *options.response_code = 200;
+        return SASL_OK;
+      });
+
+  const std::string endpoint = "https://limited.example.com/token";
+  auto write_token = [&endpoint](time_t expiry) {
+    const std::string expiry_str = std::to_string(expiry);
+    FILE *f = OpenTempTokenFile();
+    fprintf(f, kTokenTemplateWithOverrides, "access", "refresh",
+            expiry_str.c_str(), endpoint.c_str(), "secret");
+    fclose(f);
+  };
+
+  auto log = sasl_xoauth2::Log::Create();
+  std::string token;
+  write_token(time(nullptr) + 5);
+  auto store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "refreshed_access");
+  TEST_ASSERT(requests == 1);
+
+  // Past the limit, a token in its refresh window is used until it expires.
+  write_token(time(nullptr) + 5);
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT_OK(store->GetAccessToken(&token));
+  TEST_ASSERT(token == "access");
+
+  // An expired one can't be.
+  write_token(0);
+  store = sasl_xoauth2::TokenStore::Create(log.get(), s_password);
+  TEST_ASSERT(store != nullptr);
+  TEST_ASSERT(store->GetAccessToken(&token) == SASL_UNAVAIL);
+  TEST_ASSERT(requests == 1);
+
+  sasl_xoauth2::RateLimiter::ResetForTesting();
+  TEST_ASSERT(sasl_xoauth2::RateLimiter::Acquire("key", 600, 2, no_wait));
+  return true;
+}
+
 int main(int argc, char **argv) {
   sasl_xoauth2::EnableLoggingForTesting();
 
@@ -660,8 +2173,34 @@ int main(int argc, char **argv) {
   TEST_ABORT(TestWithCallbacksAndOtherOverrides(plug));
   TEST_ABORT(TestWithPermanentError(plug));
   TEST_ABORT(TestWithTokenExpiredError(plug));
+  TEST_ABORT(TestClientReuse(plug));
   TEST_ABORT(TestPreemptiveTokenRefresh(plug));
   TEST_ABORT(TestFailedPreemptiveTokenRefresh(plug));
+  TEST_ABORT(TestRefreshBackoff());
+  TEST_ABORT(TestTokenCache());
+  TEST_ABORT(TestConcurrentRefreshIsCoalesced());
+  TEST_ABORT(TestFailedReloadDropsOverrides());
+  TEST_ABORT(TestRefreshThatThrows());
+  TEST_ABORT(TestRefreshDoesNotCopySettings());
+  TEST_ABORT(TestTransportOptions());
+  TEST_ABORT(TestInitialResponse());
+  TEST_ABORT(TestTokenResponseParser());
+  TEST_ABORT(TestServerChallenge());
+  TEST_ABORT(TestBufferedLog());
+  TEST_ABORT(TestBinaryTokenFormat());
+  TEST_ABORT(TestBackgroundRefresh());
+  TEST_ABORT(TestTokenIndex());
+  TEST_ABORT(TestMetrics());
+  TEST_ABORT(TestSharedTokenCache());
+  TEST_ABORT(TestSharedSlotTable());
+  TEST_ABORT(TestCircuitBreaker());
+  TEST_ABORT(TestHedgedRequest());
+  TEST_ABORT(TestHttpTimings());
+  TEST_ABORT(TestStopHttpAsync(plug));
+  TEST_ABORT(TestCaCertificates());
+  TEST_ABORT(TestConfigReload());
+  TEST_ABORT(TestIdleRefresh(plug));
+  TEST_ABORT(TestRateLimiter());
 
   Cleanup();
   fprintf(stderr, "\nALL TESTS PASS.\n");